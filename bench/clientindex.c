@@ -0,0 +1,71 @@
+/*
+ * clientindex - cost of wintoclient() as the number of managed clients grows.
+ *
+ * Builds maxwelm.c in, so it measures the real hash index. No X display is
+ * needed: clients are linked into desktops[] and the index directly.
+ */
+
+#define main maxwelm_main
+#include "../maxwelm.c"
+#undef main
+
+#include <time.h>
+
+#define LOOKUPS 10000000
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* spread windows over a few dozen fake X clients, like a real session */
+static Window fakexid(int i)
+{
+    return ((Window)(1 + i % 48) << 21) | (0x200000 / 2 + i / 48);
+}
+
+int main(void)
+{
+    static const int sizes[] = {10, 100, 1000, 5000, 10000, 50000};
+    struct client *c;
+    unsigned int i, n, b, chain, maxchain;
+    double t;
+    Window *wins;
+    volatile Window sink = 0;
+
+    printf("%8s %12s %10s\n", "clients", "ns/lookup", "maxchain");
+    for (n = 0; n < LENGTH(sizes); n++) {
+        wins = calloc(sizes[n], sizeof(*wins));
+        for (i = 0; i < sizes[n]; i++) {
+            c = clientalloc();
+            c->win = wins[i] = fakexid(i);
+            c->frame = ((Window)49 << 21) | i; /* maxwelm creates the frames */
+            c->desktop = i % LENGTH(desktops);
+            save_desktop(currentdesktop);
+            select_desktop(c->desktop);
+            attach(c);
+            hashadd(c);
+        }
+
+        maxchain = 0;
+        for (b = 0; b < clienthash_size; b++) {
+            for (chain = 0, c = clienthash[b]; c; c = c->hnext)
+                chain++;
+            maxchain = MAX(maxchain, chain);
+        }
+
+        t = now();
+        for (i = 0; i < LOOKUPS; i++)
+            sink ^= wintoclient(wins[(i * 7919) % sizes[n]])->win;
+        t = now() - t;
+        printf("%8d %12.2f %10u\n", sizes[n], t / LOOKUPS, maxchain);
+
+        for (i = 0; i < sizes[n]; i++)
+            remove_window(wins[i]);
+        free(wins);
+    }
+    return sink == 1;
+}
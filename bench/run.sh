@@ -0,0 +1,47 @@
+#!/bin/sh
+# Start Xvfb and maxwelm on a spare display and run xbench against them.
+# usage: bench/run.sh [windows] [repeats]    (BENCH_DISPLAY, default :99)
+# With BENCH_CAPTURE set, replay that maxwelm -R capture instead.
+
+display=${BENCH_DISPLAY:-:99}
+dir=$(dirname "$0")
+
+if ! command -v Xvfb >/dev/null; then
+    echo "run.sh: Xvfb not found, skipping the X benchmarks"
+    exit 0
+fi
+
+Xvfb "$display" -screen 0 1280x800x24 -nolisten tcp 2>/dev/null &
+xvfb=$!
+for i in $(seq 50); do
+    [ -e "/tmp/.X11-unix/X${display#:}" ] && break
+    sleep 0.1
+done
+
+if [ -n "$BENCH_CAPTURE" ]; then
+    DISPLAY=$display "$dir/../maxwelm" -P "$BENCH_CAPTURE"
+    status=$?
+    kill $xvfb 2>/dev/null
+    wait 2>/dev/null
+    exit $status
+fi
+
+# where maxwelm puts its control socket, see ctllisten()
+case $XDG_RUNTIME_DIR in
+/*) sockdir=$XDG_RUNTIME_DIR ;;
+*) sockdir=/tmp/maxwelm-$(id -u) ;;
+esac
+
+DISPLAY=$display "$dir/../maxwelm" >/dev/null &
+wm=$!
+for i in $(seq 50); do
+    [ -S "$sockdir/maxwelm$display.sock" ] && break
+    sleep 0.1
+done
+
+DISPLAY=$display "$dir/xbench" "$@"
+status=$?
+
+kill $wm $xvfb 2>/dev/null
+wait 2>/dev/null
+exit $status
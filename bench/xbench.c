@@ -0,0 +1,403 @@
+/*
+ * xbench - latency of a running maxwelm under scripted load, see run.sh.
+ *
+ * Plays a crowd of plain X clients plus a user at the keyboard and mouse
+ * (through XTEST), and reads maxwelm's request and round trip counters
+ * from its control socket before and after every scenario. Each operation
+ * is timed from the moment we act until its effect reaches a client:
+ *
+ *   map      N windows mapped at once, until each one is mapped in a frame
+ *   alt-tab  Alt+Tab, until the next window gets the input focus
+ *   desktop  Alt+1 / Alt+2, until the other desktop's window gets the focus
+ *   drag     Alt+Button1 drag, until the window hears of its new position
+ *   title    _NET_WM_NAME change, until maxwelm shows it as the title
+ *
+ * Alt+Tab runs again as alt-tab2 once half the windows went to desktop 2.
+ * xbench fails if the requests per focus change differ between the two,
+ * or if maxwelm allocates a color during any scenario.
+ *
+ * usage: xbench [windows] [repeats]
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/keysym.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define TIMEOUT 2000 /* ms to wait for one operation before counting it lost */
+#define X_XTestFakeInput 2
+
+static Display *dpy;
+static xcb_connection_t *xc;        /* XTEST requests, sent raw */
+static uint8_t xtest;               /* XTEST major opcode */
+static char ctlpath[108];
+static Window root;
+static Window *wins;
+static int nwins;
+static double *lat;                 /* latencies of the running scenario, ms */
+static int nlat;
+static int lost;
+static unsigned long reqs0, trips0, focus0, focusreqs0;
+static double focuscost;            /* focus() requests per focus change, see end() */
+static Atom netwmname, utf8string;
+static xcb_extension_t xtestext = {"XTEST", 0};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* send one command to maxwelm and read the whole reply */
+static int ctl(const char *cmd, char *reply, size_t size)
+{
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    ssize_t n, len = 0;
+    int fd;
+
+    memcpy(sa.sun_path, ctlpath, sizeof(sa.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        fprintf(stderr, "xbench: can't connect to %s\n", ctlpath);
+        exit(1);
+    }
+    write(fd, cmd, strlen(cmd));
+    write(fd, "\n", 1);
+    while (len < size - 1 && (n = read(fd, reply + len, size - 1 - len)) > 0)
+        len += n;
+    reply[len] = '\0';
+    close(fd);
+    return len;
+}
+
+static unsigned long ctlvalue(const char *reply, const char *key)
+{
+    const char *p = strstr(reply, key);
+
+    return p ? strtoul(p + strlen(key), NULL, 0) : 0;
+}
+
+/* XTEST FakeInput; xcb has no header for the extension here, so by hand */
+static void fake(int type, int detail, int x, int y)
+{
+    uint8_t req[36] = {0};
+    struct iovec iov[3];
+    xcb_protocol_request_t pr = {.count = 1, .ext = NULL, .opcode = xtest, .isvoid = 1};
+    uint32_t r = root;
+    int16_t rx = x, ry = y;
+
+    req[1] = X_XTestFakeInput;
+    req[4] = type;
+    req[5] = detail;
+    memcpy(req + 12, &r, 4);
+    memcpy(req + 24, &rx, 2);
+    memcpy(req + 26, &ry, 2);
+    iov[2].iov_base = req;
+    iov[2].iov_len = sizeof(req);
+    xcb_send_request(xc, 0, iov + 2, &pr);
+    xcb_flush(xc);
+}
+
+static void key(KeySym mod, KeySym sym)
+{
+    int m = XKeysymToKeycode(dpy, mod), k = XKeysymToKeycode(dpy, sym);
+
+    fake(KeyPress, m, 0, 0);
+    fake(KeyPress, k, 0, 0);
+    fake(KeyRelease, k, 0, 0);
+    fake(KeyRelease, m, 0, 0);
+}
+
+/* wait for an event of type on one of our windows, accepted by match */
+static Bool waitfor(int type, XEvent *ev, Bool (*match)(XEvent *ev, long arg), long arg)
+{
+    struct pollfd pfd = {.fd = ConnectionNumber(dpy), .events = POLLIN};
+    double deadline = now() + TIMEOUT;
+
+    for (;;) {
+        while (XPending(dpy)) {
+            XNextEvent(dpy, ev);
+            if (ev->type == type && (!match || match(ev, arg)))
+                return True;
+        }
+        if (now() >= deadline || poll(&pfd, 1, deadline - now()) <= 0) {
+            lost++;
+            return False;
+        }
+    }
+}
+
+static Bool focusother(XEvent *ev, long win)
+{
+    return ev->xfocus.window != (Window)win && ev->xfocus.mode == NotifyNormal;
+}
+
+static Bool moved(XEvent *ev, long x)
+{
+    return ev->xconfigure.send_event && ev->xconfigure.x != x;
+}
+
+static Bool mapped(XEvent *ev, long unused)
+{
+    return True;
+}
+
+static void begin(void)
+{
+    char reply[256];
+
+    ctl("stats", reply, sizeof(reply));
+    reqs0 = ctlvalue(reply, "requests ");
+    trips0 = ctlvalue(reply, "roundtrips ");
+    focus0 = ctlvalue(reply, "focuschanges ");
+    focusreqs0 = ctlvalue(reply, "focusreqs ");
+    nlat = 0;
+    lost = 0;
+}
+
+static int cmp(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void end(const char *name)
+{
+    char reply[256];
+    unsigned long reqs, trips, focus;
+    int ops = nlat + lost;
+
+    ctl("stats", reply, sizeof(reply));
+    reqs = ctlvalue(reply, "requests ") - reqs0;
+    trips = ctlvalue(reply, "roundtrips ") - trips0;
+    focus = ctlvalue(reply, "focuschanges ") - focus0;
+    focuscost = focus ? (double)(ctlvalue(reply, "focusreqs ") - focusreqs0) / focus : 0;
+    qsort(lat, nlat, sizeof(*lat), cmp);
+    printf("%-8s %6d %9.3f %9.3f %6d %10lu %8.1f %10lu %8.2f\n", name, nlat,
+            nlat ? lat[nlat / 2] : 0, nlat ? lat[MIN(nlat - 1, nlat * 99 / 100)] : 0, lost,
+            reqs, ops ? (double)reqs / ops : 0, trips, ops ? (double)trips / ops : 0);
+}
+
+static Window focusedwin(void)
+{
+    char reply[512];
+
+    ctl("info", reply, sizeof(reply));
+    return ctlvalue(reply, "focused ");
+}
+
+/* N windows mapped in one go, each timed until maxwelm maps it framed */
+static void storm(void)
+{
+    XSetWindowAttributes wa = {.event_mask = StructureNotifyMask|FocusChangeMask};
+    XEvent ev;
+    double t0;
+    char name[32];
+    int i, n;
+
+    begin();
+    for (i = 0; i < nwins; i++) {
+        wins[i] = XCreateWindow(dpy, root, 20 + i % 200, 20 + i % 150, 320, 240, 0,
+                CopyFromParent, InputOutput, CopyFromParent, CWEventMask, &wa);
+        snprintf(name, sizeof(name), "xbench %d", i);
+        XStoreName(dpy, wins[i], name);
+    }
+    XSync(dpy, False);
+    t0 = now();
+    for (i = 0; i < nwins; i++)
+        XMapWindow(dpy, wins[i]);
+    XFlush(dpy);
+    for (n = 0; n < nwins; n++) {
+        if (!waitfor(MapNotify, &ev, mapped, 0)) {
+            lost += nwins - n - 1; /* give up on the rest too */
+            break;
+        }
+        lat[nlat++] = now() - t0;
+    }
+    end("map");
+}
+
+/* returns the focus() requests per focus change */
+static double alttab(int repeats, const char *name)
+{
+    XEvent ev;
+    Window w;
+    double t0;
+    int i;
+
+    begin();
+    for (i = 0; i < repeats; i++) {
+        w = focusedwin();
+        t0 = now();
+        key(XK_Alt_L, XK_Tab);
+        if (waitfor(FocusIn, &ev, focusother, w))
+            lat[nlat++] = now() - t0;
+    }
+    end(name);
+    return focuscost;
+}
+
+/* half the windows move to desktop 2, then flip between 1 and 2 */
+static void desktops(int repeats)
+{
+    char reply[64];
+    XEvent ev;
+    Window w;
+    double t0;
+    int i;
+
+    for (i = 0; i < nwins / 2; i++)
+        ctl("todesktop 2", reply, sizeof(reply));
+    XSync(dpy, False);
+    while (XPending(dpy))
+        XNextEvent(dpy, &ev);
+
+    begin();
+    for (i = 0; i < repeats; i++) {
+        w = focusedwin();
+        t0 = now();
+        key(XK_Alt_L, i % 2 ? XK_1 : XK_2);
+        if (waitfor(FocusIn, &ev, focusother, w))
+            lat[nlat++] = now() - t0;
+    }
+    end("desktop");
+}
+
+static void drag(int repeats)
+{
+    XEvent ev;
+    Window w = focusedwin(), child;
+    double t0;
+    int i, x, y, last;
+
+    if (w == None)
+        return;
+    XTranslateCoordinates(dpy, w, root, 0, 0, &last, &y, &child);
+    x = last + 10;
+    y += 10;
+
+    begin();
+    fake(MotionNotify, 0, x, y);
+    fake(KeyPress, XKeysymToKeycode(dpy, XK_Alt_L), 0, 0);
+    fake(ButtonPress, 1, 0, 0);
+    for (i = 0; i < repeats; i++) {
+        t0 = now();
+        fake(MotionNotify, 0, x + (i % 2 ? 0 : 40), y + (i % 2 ? 0 : 20));
+        if (waitfor(ConfigureNotify, &ev, moved, last)) {
+            lat[nlat++] = now() - t0;
+            last = ev.xconfigure.x;
+        }
+    }
+    fake(ButtonRelease, 1, 0, 0);
+    fake(KeyRelease, XKeysymToKeycode(dpy, XK_Alt_L), 0, 0);
+    end("drag");
+}
+
+/* each title is timed until the control socket reports it */
+static void titles(int repeats)
+{
+    char title[64], reply[512], *p;
+    Window w = focusedwin();
+    double t0;
+    int i;
+
+    if (w == None)
+        return;
+    begin();
+    for (i = 0; i < repeats; i++) {
+        snprintf(title, sizeof(title), "xbench title %d", i);
+        t0 = now();
+        XChangeProperty(dpy, w, netwmname, utf8string, 8, PropModeReplace,
+                (unsigned char *)title, strlen(title));
+        XSync(dpy, False);
+        for (;;) {
+            ctl("info", reply, sizeof(reply));
+            if ((p = strstr(reply, "title ")) && !strncmp(p + 6, title, strlen(title))
+                    && p[6 + strlen(title)] == '\n') {
+                lat[nlat++] = now() - t0;
+                break;
+            }
+            if (now() - t0 > TIMEOUT) {
+                lost++;
+                break;
+            }
+        }
+    }
+    end("title");
+}
+
+int main(int argc, char *argv[])
+{
+    const xcb_query_extension_reply_t *ext;
+    const char *dir;
+    char reply[256];
+    unsigned long colors;
+    double full, half;
+    int halfwins, repeats;
+
+    nwins = argc > 1 ? atoi(argv[1]) : 200;
+    repeats = argc > 2 ? atoi(argv[2]) : 200;
+    if (!(dpy = XOpenDisplay(NULL)) || xcb_connection_has_error(xc = xcb_connect(NULL, NULL))) {
+        fprintf(stderr, "xbench: can't open display\n");
+        return 1;
+    }
+    if (!(ext = xcb_get_extension_data(xc, &xtestext)) || !ext->present) {
+        fprintf(stderr, "xbench: the server has no XTEST\n");
+        return 1;
+    }
+    xtest = ext->major_opcode;
+    root = DefaultRootWindow(dpy);
+    netwmname = XInternAtom(dpy, "_NET_WM_NAME", False);
+    utf8string = XInternAtom(dpy, "UTF8_STRING", False);
+    /* where maxwelm's ctllisten() puts it */
+    if ((dir = getenv("XDG_RUNTIME_DIR")) && dir[0] == '/')
+        snprintf(ctlpath, sizeof(ctlpath), "%s/maxwelm%s.sock", dir, DisplayString(dpy));
+    else
+        snprintf(ctlpath, sizeof(ctlpath), "/tmp/maxwelm-%u/maxwelm%s.sock",
+                (unsigned int)getuid(), DisplayString(dpy));
+    wins = calloc(nwins, sizeof(*wins));
+    lat = calloc(nwins > repeats ? nwins : repeats, sizeof(*lat));
+
+    printf("%d windows, %d repeats\n", nwins, repeats);
+    printf("%-8s %6s %9s %9s %6s %10s %8s %10s %8s\n", "scenario", "ops", "p50 ms", "p99 ms",
+            "lost", "requests", "req/op", "roundtrips", "rt/op");
+    ctl("stats", reply, sizeof(reply));
+    colors = ctlvalue(reply, "colorallocs ");
+    storm();
+    full = alttab(repeats, "alt-tab");
+    drag(repeats);
+    titles(repeats);
+    desktops(repeats);
+    ctl("info", reply, sizeof(reply));
+    halfwins = ctlvalue(reply, "windows ");
+    half = alttab(repeats, "alt-tab2");
+    ctl("stats", reply, sizeof(reply));
+    colors = ctlvalue(reply, "colorallocs ") - colors;
+
+    XCloseDisplay(dpy);
+    xcb_disconnect(xc);
+    if (full - half > 0.01 || half - full > 0.01) {
+        fprintf(stderr, "xbench: %.2f requests per focus change at %d windows, %.2f at %d\n",
+                full, nwins, half, halfwins);
+        return 1;
+    }
+    if (colors != 0) {
+        fprintf(stderr, "xbench: %lu colors allocated during the scenarios\n", colors);
+        return 1;
+    }
+    return 0;
+}
@@ -4,6 +4,62 @@
 /* Mod (Mod1 == alt) */
 #define MOD Mod1Mask
 
+/* Max configure requests per second for a window being dragged or moved */
+#define MOTION_HZ 60
+
+/*
+ * Holding a move/resize key grows the step by RESIZER every ACCEL_REPEATS
+ * autorepeats, up to ACCEL_MAX times RESIZER.
+ */
+#define ACCEL_REPEATS 4
+#define ACCEL_MAX 8
+
+/*
+ * Unmap windows that windows stacked above them cover completely, and mark
+ * them _NET_WM_STATE_HIDDEN, so they stop painting. 0 keeps them mapped.
+ */
+#define CULL_OCCLUDED 1
+
+/*
+ * Set THROTTLE_BACKGROUND to 1 to slow down the processes of windows left
+ * on desktops that are not shown, found through _NET_WM_PID. Only classes
+ * listed in throttles[] are touched. CPU 0 stops the process (SIGSTOP), any
+ * other value caps it at that percentage of one CPU through the cpu.max of
+ * its cgroup v2 group, which needs the group to be writable and not shared
+ * with maxwelm. Processes resume as soon as one of their windows is shown.
+ */
+#define THROTTLE_BACKGROUND 0
+static const struct throttle throttles[] = {
+    /*CLASS            CPU */
+    { "Firefox",       5 },
+    { "Chromium",      5 },
+    { "mpv",           0 },
+};
+
+/*
+ * What a window we manage gets when it asks to move or resize, by its
+ * WM_CLASS class; classes not listed get CONFIGURE_DEFAULT. ConfigAllow
+ * applies the request, ConfigDeny never does, ConfigMaxed refuses while
+ * the window is maximized. A refused window is told it stays where it is.
+ * Beyond CONFIGURE_BURST requests in a second, a window is refused for the
+ * rest of that second whatever its rule, which stops resize loops.
+ */
+#define CONFIGURE_DEFAULT ConfigMaxed
+#define CONFIGURE_BURST 20
+static const struct configrule configrules[] = {
+    /*CLASS            POLICY */
+    { "mpv",           ConfigAllow },
+    { "Gimp",          ConfigAllow },
+};
+
+/*
+ * What the trace ring keeps, read back with the trace command or written
+ * to stderr on a crash: 0 nothing, compiled out; 1 windows managed and
+ * unmanaged, focus and desktop changes, key actions and X errors; 2 also
+ * every event, configure request, title and bar redraw.
+ */
+#define TRACE_LEVEL 1
+
 /* Colors */
 #define UNFOCUS "rgb:1c/1c/1c"
 static char* focuscolors[10] = {  /* initialize 10 colors */
@@ -19,11 +75,18 @@ static char* focuscolors[10] = {  /* initialize 10 colors */
     "rgb:89/9c/a1",
 };
 
+/*
+ * Control socket, %s is replaced by the display name. It is created in
+ * $XDG_RUNTIME_DIR, or in /tmp/maxwelm-UID if that is not set
+ * ($XDG_RUNTIME_DIR/maxwelm:0.sock). See README for the commands it accepts.
+ */
+#define CTL_SOCKET "maxwelm%s.sock"
+
 /* 
  * Status bar script command name.
- * If there is none, change it to ""
+ * If there is none, change it to "" to use the built-in segments below.
  */
-#define STATUS_BAR_SCRIPT "statusbar.sh"
+#define STATUS_BAR_SCRIPT ""
 
 /*
  * If STATUS_BAR_SCRIPT is not in your PATH,
@@ -31,10 +94,24 @@ static char* focuscolors[10] = {  /* initialize 10 colors */
  *   statusbarcmd[] = {"./path/to/script/"STATUS_BAR_SCRIPT, NULL};
  */
 const char* statusbarcmd[] = {STATUS_BAR_SCRIPT, NULL};          /* do not remove this line */
-const char* killstatusbarcmd[] = {"killall", STATUS_BAR_SCRIPT}; /* do not remove this line */
+const char* killstatusbarcmd[] = {"killall", STATUS_BAR_SCRIPT, NULL}; /* do not remove this line */
 const char* dmenucmd[] = {"dmenu_run",NULL};       /* replace with another launcher program */
 const char* termcmd[]  = {"urxvt",NULL};          /* replace with another terminal emulator */
 
+/*
+ * Built-in status text, shown when STATUS_BAR_SCRIPT is "".
+ * Segments are read straight from /proc and /sys without starting any
+ * process, each one every INTERVAL seconds.
+ */
+static struct segment segments[] = {
+    /*FUNCTION         ARG        INTERVAL */
+    { status_battery,  NULL,      30 },
+    { status_net,      "wlp3s0",  5  },     /* shown while the interface is down */
+    { status_cpu,      NULL,      2  },
+    { status_ram,      NULL,      2  },
+    { status_clock,    "%I:%M",   60 },     /* strftime(3) format */
+};
+
 static struct key keys[] = {
     /*MOD              KEY        FUNCTION           ARGS */
     { MOD,             XK_m,      max_win,           {NULL}},
@@ -42,6 +119,7 @@ static struct key keys[] = {
     { MOD,             XK_Tab,    next_win,          {NULL}},
     { MOD|ShiftMask,   XK_Tab,    prev_win,          {NULL}},
     { MOD|ControlMask, XK_t,      quit_wm,           {NULL}},
+    { MOD|ControlMask, XK_r,      restart_wm,        {NULL}},      /* exec maxwelm again, layout kept */
     /* run commands */
     { MOD,             XK_p,      spawn,             {.com = dmenucmd}},
     { MOD,             XK_Return, spawn,             {.com = termcmd}},
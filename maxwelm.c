@@ -6,26 +6,84 @@
  * Borrowed interactive pointer move/resize code from TinyWM. 
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <dirent.h>
+#include <time.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/XKBlib.h>
+#include <xcb/xcb.h>
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define LENGTH(X) (sizeof(X) / sizeof(*X))
+#define CLEANMASK(mask) ((mask) & ~(numlockmask|LockMask) \
+        & (ShiftMask|ControlMask|Mod1Mask|Mod2Mask|Mod3Mask|Mod4Mask|Mod5Mask))
 #define RESIZER 20
 #define TOPBAR 15
 #define WINBORDER 1
+#define UNFOCUSED 10 /* index of UNFOCUS in colors[] and gcs[] */
+#define CTL_CLIENTS 4 /* control socket connections served at once */
+#define CTL_TIMEOUT 2000000000UL /* ns a connection has to send its line */
+#define CLIENT_SLAB 64 /* clients the pool allocates at a time */
+#define TITLE_MAX 4096 /* longest title kept, in bytes */
+#define TITLESIZE(len) (sizeof(unsigned int) + (len) + 1) /* length, text, NUL */
+#define STATE_ENTRY 6 /* words per client in _MAXWELM_STATE, see savestate() */
+#define STATE_CURRENT 0x100 /* flag in the desktop word of a current client */
+#define HIST_SUB 4 /* histogram buckets per power of two, see histbucket() */
+#define HIST_BUCKETS (64 * HIST_SUB)
+#define TRACE_SIZE 4096 /* entries in the trace ring, a power of two */
+#define CAPTURE_MAGIC "maxwelm\1" /* first bytes of a -R capture, the format version last */
+#define TRACE(level, id, a, b) do { if ((level) <= TRACE_LEVEL) trace(id, a, b); } while (0)
 
 enum direction {LEFT, DOWN, UP, RIGHT};
 
+/* work deferred by the handlers to the end of an event batch */
+enum { DIRTY_FOCUS = 1 << 0, DIRTY_BAR = 1 << 1, DIRTY_GEOM = 1 << 2, DIRTY_CULL = 1 << 3,
+       DIRTY_THROTTLE = 1 << 4 };
+
+/* fds watched by run(), control socket clients follow PollLast */
+enum { PollX, PollSignal, PollMotion, PollStatus, PollCtl, PollLast };
+
+/* properties of a new window fetched by querysend(), QueryDesktop by adopt() alone */
+enum { QueryNetWMName, QueryWMName, QueryClass, QueryMachine, QueryPid, QueryState,
+       QueryDesktop, QueryLast };
+
+/* trace ring entries, see tracenames[] and the TRACE_LEVEL of each TRACE() */
+enum { TraceEvent, TraceKey, TraceManage, TraceUnmanage, TraceFocus, TraceDesktop,
+       TraceConfigure, TraceTitle, TraceBar, TraceXError, TraceLast };
+
+/* what configurerequest() does for a managed client, see configrules[] */
+enum { ConfigAllow, ConfigMaxed, ConfigDeny };
+
+/* capture record types that are not X events, which start at KeyPress */
+enum { CaptureBatch, CaptureFrame };
+
+/* atoms[] indices; ICCCM first, then EWMH, then our own */
+enum {
+    WMProtocols, WMDelete,
+    NetWMName, NetWMState, NetWMStateHidden, NetWMPid, NetWMDesktop,
+    MaxwelmState,
+    AtomLast
+};
+
 typedef union {
     const char** com;
     const int i;
@@ -39,12 +97,38 @@ struct key {
     const Arg arg;
 };
 
+struct segment {
+    int (*function)(char *buf, size_t size, const char *arg);
+    const char *arg;
+    unsigned int interval;      /* seconds */
+    char text[64];              /* output of the last refresh */
+    time_t due;
+};
+
+/* allocated by clientalloc(); what every event touches comes first */
 struct client {
     struct client *next;
     struct client *prev;
+    struct client *hnext;       /* next in the same clienthash[] bucket */
+    struct client *fnext;       /* next in the same framehash[] bucket */
 
     Window win;
-	char name[256];
+    Window frame;               /* our parent window, carries the border */
+    int x, y, w, h, bw;         /* frame position, client size, frame border */
+    int desktop;
+    unsigned long stack;        /* raise order within the desktop, higher is on top */
+    unsigned long cfgserial;    /* request serial of our last configure */
+    Bool hidden;                /* frame unmapped by cull() */
+
+    unsigned int title;         /* offset in titles[], 0 is the empty title */
+    pid_t pid;                  /* local process behind the window, from _NET_WM_PID */
+    int cpu;                    /* throttles[] share while hidden, -1 for none */
+    Bool frozen;                /* throttled by throttle() */
+    int cfgpolicy;              /* Config*, from configrules[] */
+    unsigned int cfgcount;      /* configure requests since cfgsince */
+    unsigned long cfgsince;     /* start of the current second, see configurerequest() */
+    Atom *states;               /* the client's own _NET_WM_STATE, room for one more */
+    unsigned int nstates;
     int old_x;
     int old_y;
     int old_w;
@@ -56,192 +140,838 @@ struct desktop {
     struct client *current;
 };
 
+/* what happens to the process of a window of class CLASS on a hidden desktop */
+struct throttle {
+    const char *class;
+    int cpu;                    /* percent of one CPU, 0 stops the process */
+};
+
+/* how configurerequest() treats the windows of class CLASS */
+struct configrule {
+    const char *class;
+    int policy;                 /* Config* */
+};
+
+/*
+ * Everything maprequest() needs to know about a new window. The requests
+ * go out together on the query connection and the replies are collected
+ * afterwards, so the whole lot costs one round trip.
+ */
+struct query {
+    xcb_get_window_attributes_cookie_t attr;
+    xcb_get_geometry_cookie_t geom;
+    xcb_get_property_cookie_t prop[QueryLast];  /* sequence 0 when not sent */
+};
+
+/*
+ * Latency of one handler[] entry or keys[] action, as a log-linear
+ * histogram of nanoseconds: HIST_SUB buckets for every power of two,
+ * so any sample is within 25% of its bucket. See record().
+ */
+struct metric {
+    unsigned long count;
+    unsigned long requests;     /* X requests sent from inside */
+    unsigned long roundtrips;   /* replies waited for from inside */
+    unsigned long max;
+    unsigned int bucket[HIST_BUCKETS];
+};
+
+/* counters at the start of a measured call, see sample() */
+struct sample {
+    unsigned long ns;
+    unsigned long requests;
+    unsigned long roundtrips;
+};
+
+/*
+ * A capture (-R) starts with our own windows and atoms, so a replay (-P)
+ * can translate them, then holds one struct capturerec per handled event,
+ * each followed by its len bytes: the X event, or for CaptureFrame the
+ * client and frame windows. Captures only replay on the same architecture.
+ */
+struct capturehead {
+    char magic[8];              /* CAPTURE_MAGIC */
+    unsigned int word;          /* sizeof(long) */
+    unsigned int natoms;        /* AtomLast */
+    Window root;
+    Window bar;
+    Window containers[10];
+    Atom atoms[AtomLast];
+};
+
+struct capturerec {
+    unsigned int us;            /* since the previous record, saturated */
+    unsigned short type;        /* X event type, or Capture* */
+    unsigned short len;
+};
+
+/* recorded window -> replay window, see replaywin() */
+struct xidmap {
+    Window from;
+    Window to;
+};
+
+/* one entry of the trace ring, written by trace() */
+struct trace {
+    unsigned long ns;           /* start of the handler it happened in */
+    unsigned long serial;       /* next Xlib request at the time */
+    unsigned int id;            /* Trace* */
+    unsigned int a, b;          /* meaning depends on id, see tracenames[] */
+};
+
+/* accepted control connection and the part of its line read so far */
+struct ctlconn {
+    int fd;                     /* or -1 */
+    unsigned int len;
+    unsigned long since;        /* accepted, see ctlaccept() */
+    char buf[512];
+};
+
+/* control socket command; actions take an optional integer argument */
+struct command {
+    const char *name;
+    void (*action)(const Arg arg);
+    void (*query)(int fd, const char *args);
+};
+
 /* declare functions */
-static void add_window(Window w);
+static struct client *add_window(Window w, XWindowAttributes *wa, struct query *q);
+static void adopt();
+static struct client *adoptwin(int d, Window w, XWindowAttributes *wa, struct query *q);
+static void applyrules(struct client *c, struct query *q);
+static void armtimer(int fd, long ms);
+static void attach(struct client *c);
 static void buttonpress(XEvent *ev);
 static void buttonrelease(XEvent *ev);
+static void capture(unsigned int type, const void *data, unsigned int len);
+static void captureopen(const char *path);
+static int cgroupcpu(pid_t pid, const char *max);
 static void change_desktop(const Arg arg);
+static void checkotherwm();
 static void cleanup();
+static void commit();
 static void client_to_desktop(const Arg arg);
+static struct client *clientalloc();
+static void clientfree(struct client *c);
+static const char *clienttitle(struct client *c);
 static void close_win();
+static void configure(struct client *c);
+static void configurenotify(XEvent *ev);
 static void configurerequest(XEvent *e);
+static void ctlaccept();
+static void ctlinfo(int fd, const char *args);
+static void ctllatency(int fd, const char *args);
+static void ctllisten();
+static void ctlmemory(int fd, const char *args);
+static void ctlmetric(int fd, const char *name, const struct metric *m);
+static void ctlread(int i);
+static void ctlreply(int fd, const char *fmt, ...);
+static void ctlstats(int fd, const char *args);
+static void ctlstatus(int fd, const char *args);
+static void ctltrace(int fd, const char *args);
+static void cull();
 static void destroynotify(XEvent *ev);
+static void detach(struct client *c);
+static void drag(int x_root, int y_root);
 static void drawbar();
+static void expose(XEvent *ev);
+static void flushgeom();
+static void focus(struct client *c);
+static void freeze(struct client *c, Bool frozen);
+static struct client *frametoclient(Window frame);
 static unsigned long getcolor(const char* color);
-static Bool gettextprop(Window w, Atom atom, char *text, unsigned int size);
+static xcb_get_property_cookie_t getprop(Window w, Atom atom);
+static xcb_get_property_reply_t *getreply(xcb_get_property_cookie_t ck);
+static Bool gettextprop(xcb_get_property_cookie_t ck, char *text, unsigned int size);
 static void grabinput();
+static void handle(XEvent *ev);
+static unsigned int hash(Window w);
+static unsigned int hashxid(Window w);
+static unsigned int histbucket(unsigned long ns);
+static unsigned long histpercentile(const struct metric *m, unsigned int pct);
+static void hashadd(struct client *c);
+static void hashdel(struct client *c);
+static void initstates(struct client *c, xcb_get_property_cookie_t ck);
+static Bool ismaxed(struct client *c);
 static void keypress(XEvent *ev);
+static void keyrelease(XEvent *ev);
+static void mappingnotify(XEvent *ev);
 static void maprequest(XEvent *ev);
 static void max_win();
+static unsigned long monotonic();
 static void motionnotify(XEvent *ev);
+static void motiontimer();
 static void move_win(const Arg arg);
+static void moveresize(struct client *c, int x, int y, int w, int h);
 static void next_win();
 static void prev_win();
 static void propertynotify(XEvent *ev);
+static void putstates(struct client *c, Bool hidden);
+static void querydiscard(struct query *q);
+static Bool queryrecv(struct query *q, XWindowAttributes *wa, Bool viewable);
+static void querysend(Window w, struct query *q);
 static void quit_wm();
+static int readfile(const char *path, char *buf, size_t size);
+static void record(struct metric *m, const struct sample *s);
 static void remove_window(Window w);
+static void replaybatch();
+static void replayend();
+static void replayopen(const char *path);
+static Bool replayread();
+static int replaywait();
+static void replaymap(Window from, Window to);
+static void replaytranslate(XEvent *ev);
+static Window replaywin(Window w, Bool create);
+static void replywait(unsigned int seq);
 static void resize_win(const Arg arg);
+static void restart_wm();
 static void run();
+static void sample(struct sample *s);
 static void save_desktop(int d);
+static void savestate();
 static void select_desktop(int d);
 static void send_kill_signal(Window w);
-static GC setcolor(const char* col);
+static void setdesktop(struct client *c);
+static void setgeom(struct client *c, int x, int y, int w, int h);
+static void sethidden(struct client *c, Bool hidden);
+static void settitle(struct client *c, xcb_get_property_cookie_t netname, xcb_get_property_cookie_t name);
 static void setup();
-static void sigchld(int unused);
+static void signalread();
 static void spawn(const Arg arg);
-static void update_all_titles();
-static void update_all_windows();
+static int stackcmp(const void *a, const void *b);
+static int status_battery(char *buf, size_t size, const char *arg);
+static int status_clock(char *buf, size_t size, const char *arg);
+static int status_cpu(char *buf, size_t size, const char *arg);
+static int status_net(char *buf, size_t size, const char *arg);
+static int status_ram(char *buf, size_t size, const char *arg);
+static void statusstop();
+static void statustimer();
+static void throttle();
+static unsigned int titleappend(const char *text, unsigned int len);
+static void titlecompact();
+static void titleset(struct client *c, const char *text, unsigned int len);
+static void trace(unsigned int id, unsigned int a, unsigned int b);
+static void tracecrash(int sig);
+static int tracefmt(char *buf, const struct trace *t);
+static char *tracenum(char *p, unsigned long v, unsigned int base, int width);
+static void unmanage(struct client *c, Bool destroyed);
+static void unmapnotify(XEvent *ev);
 static void update_status(void);
 static void update_title(struct client *c);
+static struct client *wintoclient(Window w);
+static int xerror(Display *dpy, XErrorEvent *ee);
+static int xerrorstart(Display *dpy, XErrorEvent *ee);
 
 /* variables */
+static Atom atoms[AtomLast];        /* interned in one batch by setup() */
+static const char *atomnames[AtomLast] = {
+    [WMProtocols] = "WM_PROTOCOLS",
+    [WMDelete] = "WM_DELETE_WINDOW",
+    [NetWMName] = "_NET_WM_NAME",
+    [NetWMState] = "_NET_WM_STATE",
+    [NetWMStateHidden] = "_NET_WM_STATE_HIDDEN",
+    [NetWMPid] = "_NET_WM_PID",
+    [NetWMDesktop] = "_NET_WM_DESKTOP",
+    [MaxwelmState] = "_MAXWELM_STATE",
+};
 static XWindowAttributes attr;
-static Colormap cmap;
-static XColor color;
-static unsigned int color_light;
-static unsigned int color_dark;
+static char bar_desk[32];           /* bar contents as last painted */
+static int bar_desk_w;
+static int bar_desktop = -1;
+static char bar_status[256];
+static int bar_status_w;
+static char bar_title[256 + 2];
+static Pixmap barpix;
+static Window barwin;
+static FILE *capturefile;           /* -R: handled events are written here */
+static Bool capturepending;         /* records since the last CaptureBatch */
+static unsigned long capturens;     /* time of the last record written */
+static const unsigned short capturesizes[LASTEvent] = {
+    [ButtonPress] = sizeof(XButtonEvent),
+    [ButtonRelease] = sizeof(XButtonEvent),
+    [ConfigureNotify] = sizeof(XConfigureEvent),
+    [ConfigureRequest] = sizeof(XConfigureRequestEvent),
+    [DestroyNotify] = sizeof(XDestroyWindowEvent),
+    [Expose] = sizeof(XExposeEvent),
+    [KeyPress] = sizeof(XKeyEvent),
+    [KeyRelease] = sizeof(XKeyEvent),
+    [MappingNotify] = sizeof(XMappingEvent),
+    [MapRequest] = sizeof(XMapRequestEvent),
+    [MotionNotify] = sizeof(XMotionEvent),
+    [PropertyNotify] = sizeof(XPropertyEvent),
+    [UnmapNotify] = sizeof(XUnmapEvent),
+};
+static unsigned long cfgallowed;    /* configure requests of clients applied */
+static unsigned long cfgburst;      /* denied for coming faster than CONFIGURE_BURST */
+static unsigned long cfgdenied;     /* denied by configrules[] */
+static unsigned long cfgpassed;     /* of windows we do not manage, passed on */
+static unsigned long colorallocs;   /* XAllocNamedColor requests made */
+static unsigned long colors[11];    /* pixels for focuscolors[] and UNFOCUS */
+static struct client *clientpool;   /* free clients, linked by next */
+static unsigned int clientslabs;    /* CLIENT_SLAB sized allocations made */
+static const struct command commands[] = {
+    /* NAME        ACTION             QUERY */
+    { "close",     close_win,         NULL },
+    { "desktop",   change_desktop,    NULL },
+    { "info",      NULL,              ctlinfo },
+    { "latency",   NULL,              ctllatency },
+    { "max",       max_win,           NULL },
+    { "memory",    NULL,              ctlmemory },
+    { "next",      next_win,          NULL },
+    { "prev",      prev_win,          NULL },
+    { "quit",      quit_wm,           NULL },
+    { "restart",   restart_wm,        NULL },
+    { "stats",     NULL,              ctlstats },
+    { "status",    NULL,              ctlstatus },
+    { "todesktop", client_to_desktop, NULL },
+    { "trace",     NULL,              ctltrace },
+};
+static struct ctlconn ctlclients[CTL_CLIENTS];
+static int ctlfd = -1;              /* listening control socket */
+static char ctlpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static Window containers[10];       /* one per desktop, holds its frames */
+static struct metric commitmetric;  /* commit() at the end of each batch */
+static unsigned int dirty;          /* DIRTY_* flags awaiting commit() */
 static struct client *current; 
 static unsigned int currentdesktop;
 static struct desktop desktops[10];
+static struct client *dragged;      /* client under an interactive drag */
+static Bool dragpending;            /* paced pointer position not applied yet */
+static int drag_x;
+static int drag_y;
 static Display *dpy;
-static GC gc;
+static unsigned long events;        /* X events handled */
+static const char *eventnames[LASTEvent] = {
+    [ButtonPress] = "ButtonPress",
+    [ButtonRelease] = "ButtonRelease",
+    [ConfigureNotify] = "ConfigureNotify",
+    [ConfigureRequest] = "ConfigureRequest",
+    [DestroyNotify] = "DestroyNotify",
+    [Expose] = "Expose",
+    [KeyPress] = "KeyPress",
+    [KeyRelease] = "KeyRelease",
+    [MappingNotify] = "MappingNotify",
+    [MapRequest] = "MapRequest",
+    [MotionNotify] = "MotionNotify",
+    [PropertyNotify] = "PropertyNotify",
+    [UnmapNotify] = "UnmapNotify",
+};
+static struct metric eventmetrics[LASTEvent]; /* per handler[] entry */
+static struct client *focused;      /* holds the input focus and a lit border */
+static unsigned long focuschanges;
+static unsigned long focusreqs;     /* X requests sent by focus() */
+static XFontStruct *font;
+static GC gcs[11];                  /* one GC per entry of colors[] */
 static void (*handler[LASTEvent]) (XEvent *) = {
 	[ButtonPress] = buttonpress,
 	[ButtonRelease] = buttonrelease,
+	[ConfigureNotify] = configurenotify,
 	[ConfigureRequest] = configurerequest,
 	[DestroyNotify] = destroynotify,
+	[Expose] = expose,
 	[KeyPress] = keypress,
+	[KeyRelease] = keyrelease,
+	[MappingNotify] = mappingnotify,
 	[MapRequest] = maprequest,
 	[MotionNotify] = motionnotify,
-    [PropertyNotify] = propertynotify
+    [PropertyNotify] = propertynotify,
+	[UnmapNotify] = unmapnotify
 };
+static struct client *geompending; /* keyboard move/resize not sent yet */
 static struct client *head; 
+static unsigned int heldkey;        /* keycode of the key being held down */
+static unsigned int keyrepeat;      /* autorepeats of heldkey so far */
+static unsigned char keytable[256][256]; /* [keycode][CLEANMASK(state)] -> keys[] index + 1 */
+static struct client **clienthash;  /* Window -> client, across all desktops */
+static unsigned int clienthash_n;   /* clients in the table */
+static unsigned int clienthash_size; /* buckets, a power of two */
+static struct client **framehash;   /* frame -> client, clienthash_size buckets too */
+static Bool motionarmed;            /* motionfd is pacing a drag */
+static int motionfd = -1;           /* timerfd for drag pacing */
 static int maxwin_h;
 static int maxwin_w;
-static Atom NetWMName;
+static unsigned int numlockmask;
+static struct capturehead replayhead; /* of the capture being replayed */
+static unsigned long replayed;      /* events fed to the handlers so far */
+static char replaybuf[sizeof(XEvent)]; /* payload of replayrec */
+static unsigned long replaydue;     /* when replayrec is due, with replayrealtime */
+static FILE *replayfile;            /* -P: the capture driving the handlers */
+static Bool replayrealtime;         /* -t: keep the pace of the capture */
+static struct capturerec replayrec; /* next record, read ahead */
+static unsigned long replaystart;
+static struct xidmap *replayxids;   /* open addressing, from 0 is empty */
+static unsigned int replayxids_n;
+static unsigned int replayxids_size; /* a power of two */
+static unsigned long roundtrips;    /* times we blocked on a reply from the server */
+static Bool restarting;             /* exec ourselves again once cleaned up */
 static Window root;
 static Bool running = True;
 static int screen;
 static int screen_w;
 static int screen_h;
+static int sigfd = -1;              /* signalfd for SIGCHLD, SIGINT, SIGTERM */
+static struct client **stackbuf;    /* scratch for cull() */
+static unsigned int stackbuf_size;
+static unsigned long stackseq;      /* last struct client stack handed out */
 static XButtonEvent start;
+static int statusfd = -1;           /* timerfd for the built-in status */
+static Bool statusset;              /* set from outside, segments[] stay off */
 static char status_text[256];
+static char *titles;                /* arena of length-prefixed client titles */
+static unsigned int titles_dead;    /* bytes of replaced titles, see titlecompact() */
+static unsigned int titles_len;
+static unsigned int titles_size;
+static const char *tracenames[TraceLast] = {
+    [TraceEvent] = "event",             /* type, window */
+    [TraceKey] = "key",                 /* keys[] index, keysym */
+    [TraceManage] = "manage",           /* window, frame */
+    [TraceUnmanage] = "unmanage",       /* window, destroyed */
+    [TraceFocus] = "focus",             /* window, previous */
+    [TraceDesktop] = "desktop",         /* new, old */
+    [TraceConfigure] = "configure",     /* window, value mask */
+    [TraceTitle] = "title",             /* window, length */
+    [TraceBar] = "bar",                 /* span redrawn */
+    [TraceXError] = "xerror",           /* error << 8 | request, failed serial */
+};
+static unsigned long tracens;       /* stamp for trace(), set by sample() */
+static unsigned long tracepos;      /* entries ever written */
+static xcb_connection_t *xc;        /* second connection, for pipelined queries, see main() */
+static unsigned int xcbsent;        /* sequence of the newest request on xc */
+static unsigned int xcbwaited;      /* xcbsent when we last blocked on xc */
 
 /* include config here to use structs defined above */
 #include "config.h"
 
-void add_window(Window new_win)
+static struct metric keymetrics[LENGTH(keys)];
+static struct trace tracering[TRACE_LEVEL > 0 ? TRACE_SIZE : 1];
+
+/* manage new_win, its properties are read from the replies to q */
+struct client *add_window(Window new_win, XWindowAttributes *wa, struct query *q)
 {
-    struct client *newclient, *tmp;
+    struct client *newclient = clientalloc();
 
-    if (!(newclient = (struct client *)calloc(1, sizeof(struct client)))) {
-        fprintf(stderr, "calloc error!\n");
-        exit(1);
+    newclient->x = newclient->old_x = wa->x;
+    newclient->y = newclient->old_y = wa->y;
+    newclient->w = newclient->old_w = wa->width;
+    newclient->h = newclient->old_h = wa->height;
+    newclient->bw = WINBORDER;
+
+    newclient->win = new_win;
+    newclient->desktop = currentdesktop;
+    newclient->stack = ++stackseq;
+    applyrules(newclient, q);
+    initstates(newclient, q->prop[QueryState]);
+    setdesktop(newclient);
+
+    /* frame the client inside the container of its desktop */
+    XSetWindowAttributes fwa;
+    fwa.border_pixel = colors[UNFOCUSED];
+    fwa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask;
+    newclient->frame = XCreateWindow(dpy, containers[currentdesktop],
+            wa->x, wa->y, wa->width, wa->height, WINBORDER,
+            CopyFromParent, InputOutput, CopyFromParent,
+            CWBorderPixel|CWEventMask, &fwa);
+    /* the title is kept current by propertynotify() from here on */
+    XSelectInput(dpy, new_win, PropertyChangeMask);
+    XAddToSaveSet(dpy, new_win);
+    XSetWindowBorderWidth(dpy, new_win, 0);
+    XReparentWindow(dpy, new_win, newclient->frame, 0, 0);
+    XMapWindow(dpy, new_win);
+    XMapWindow(dpy, newclient->frame);
+
+    attach(newclient);
+    hashadd(newclient);
+    TRACE(1, TraceManage, new_win, newclient->frame);
+    if (capturefile) {
+        Window pair[2] = {new_win, newclient->frame};
+
+        capture(CaptureFrame, pair, sizeof(pair));
     }
 
-    static XWindowAttributes wa;
-    XGetWindowAttributes(dpy, new_win, &wa);
-    newclient->old_x = wa.x;
-    newclient->old_y = wa.y;
-    newclient->old_w = wa.width;
-    newclient->old_h = wa.height;
+    settitle(newclient, q->prop[QueryNetWMName], q->prop[QueryWMName]);
+    return newclient;
+}
 
-    newclient->win = new_win;
+/*
+ * Manage the windows already on the screen, each on the desktop its
+ * _NET_WM_DESKTOP names, or after restart_wm() where _MAXWELM_STATE puts
+ * it. Listing the children and asking about all of them take two round
+ * trips whatever their number.
+ */
+void adopt()
+{
+    xcb_query_tree_cookie_t tc;
+    xcb_get_property_cookie_t sc;
+    xcb_query_tree_reply_t *tree;
+    xcb_get_property_reply_t *sr, *dr;
+    xcb_window_t *wins;
+    struct {
+        struct query q;
+        XWindowAttributes wa;
+        int desktop;            /* -1 once adopted, or if not to be */
+    } *found;
+    struct client *c;
+    uint32_t *state = NULL;
+    int i, j, d, n = 0, nstate = 0, cur = currentdesktop;
+
+    XSync(dpy, False); /* the redirect on root is in place before we look */
+    roundtrips++;
+
+    /* the tree and whatever a restart left us, in one round trip */
+    tc = xcb_query_tree(xc, root);
+    sc = xcb_get_property(xc, 1, root, atoms[MaxwelmState], XA_CARDINAL, 0, UINT32_MAX / 4);
+    xcbsent = sc.sequence;
+    replywait(tc.sequence);
+    if ((tree = xcb_query_tree_reply(xc, tc, NULL)))
+        n = xcb_query_tree_children_length(tree);
+    if ((sr = getreply(sc)) && sr->format == 32) {
+        state = xcb_get_property_value(sr);
+        nstate = sr->value_len;
+    }
+    if (n == 0 || !(found = calloc(n, sizeof(*found)))) {
+        free(tree);
+        free(sr);
+        return;
+    }
+    wins = xcb_query_tree_children(tree);
+
+    for (i = 0; i < n; i++) {
+        querysend(wins[i], &found[i].q);
+        found[i].q.prop[QueryDesktop] = getprop(wins[i], atoms[NetWMDesktop]);
+    }
+    for (i = 0; i < n; i++) {
+        found[i].desktop = -1;
+        if (!queryrecv(&found[i].q, &found[i].wa, True))
+            continue;
+        found[i].desktop = cur;
+        if ((dr = getreply(found[i].q.prop[QueryDesktop])) && dr->format == 32
+                && *(uint32_t *)xcb_get_property_value(dr) < LENGTH(desktops))
+            found[i].desktop = *(uint32_t *)xcb_get_property_value(dr);
+        free(dr);
+        found[i].q.prop[QueryDesktop].sequence = 0;
+    }
+
+    /* after a restart, rebuild every desktop list in its old order */
+    for (j = 1; j + STATE_ENTRY <= nstate; j += STATE_ENTRY)
+        for (i = 0; i < n; i++) {
+            if (wins[i] != state[j] || found[i].desktop < 0)
+                continue;
+            d = state[j + 1] & 0xff;
+            c = adoptwin(d < LENGTH(desktops) ? d : cur, wins[i], &found[i].wa, &found[i].q);
+            c->old_x = (int32_t)state[j + 2];
+            c->old_y = (int32_t)state[j + 3];
+            c->old_w = (int32_t)state[j + 4];
+            c->old_h = (int32_t)state[j + 5];
+            found[i].desktop = -1;
+            break;
+        }
+
+    /* the rest, children come bottom to top so the last one is current */
+    for (i = 0; i < n; i++)
+        if (found[i].desktop >= 0)
+            adoptwin(found[i].desktop, wins[i], &found[i].wa, &found[i].q);
+
+    /* frames were created in list order, stack them as the windows were */
+    if (nstate > 0)
+        for (i = 0; i < n; i++)
+            if ((c = wintoclient(wins[i]))) {
+                XRaiseWindow(dpy, c->frame);
+                c->stack = ++stackseq;
+            }
+
+    /* attach() made the last client added current, put the old ones back */
+    for (j = 1; j + STATE_ENTRY <= nstate; j += STATE_ENTRY)
+        if ((state[j + 1] & STATE_CURRENT) && (c = wintoclient(state[j]))) {
+            if (c->desktop == currentdesktop)
+                current = c;
+            else
+                desktops[c->desktop].current = c;
+        }
+
+    if (nstate > 0) {
+        const Arg arg = {.i = state[0]};
+        change_desktop(arg);
+    }
+
+    free(found);
+    free(sr);
+    free(tree);
+    dirty |= DIRTY_FOCUS | DIRTY_BAR | DIRTY_THROTTLE;
+}
+
+/* add_window() on desktop d instead of the selected one */
+struct client *adoptwin(int d, Window w, XWindowAttributes *wa, struct query *q)
+{
+    struct client *c;
+    int cur = currentdesktop;
+
+    save_desktop(cur);
+    select_desktop(d);
+    c = add_window(w, wa, q);
+    save_desktop(d);
+    select_desktop(cur);
+    return c;
+}
+
+/* match c against throttles[] and configrules[], find the local process behind it */
+void applyrules(struct client *c, struct query *q)
+{
+    xcb_get_property_reply_t *class, *machine, *pid;
+    char host[256], name[256], *value;
+    int i, len;
+
+    c->cpu = -1;
+    c->cfgpolicy = CONFIGURE_DEFAULT;
+
+    /* WM_CLASS is the instance and the class, each NUL terminated, though
+     * some clients leave out the last NUL; bounded like XGetClassHint() */
+    if ((class = getreply(q->prop[QueryClass])) != NULL) {
+        value = xcb_get_property_value(class);
+        len = xcb_get_property_value_length(class);
+        i = strnlen(value, len) + 1;
+        if (i < len) {
+            len = MIN(len - i, sizeof(name) - 1);
+            memcpy(name, value + i, len);
+            name[len] = '\0';
+            for (i = 0; i < LENGTH(throttles); i++)
+                if (!strcmp(name, throttles[i].class))
+                    c->cpu = throttles[i].cpu;
+            for (i = 0; i < LENGTH(configrules); i++)
+                if (!strcmp(name, configrules[i].class))
+                    c->cfgpolicy = configrules[i].policy;
+        }
+        free(class);
+    }
+    if (!THROTTLE_BACKGROUND) {
+        c->cpu = -1;
+        return;
+    }
+    machine = getreply(q->prop[QueryMachine]);
+    pid = getreply(q->prop[QueryPid]);
+
+    /* _NET_WM_PID only means something on the machine the client runs on */
+    if (machine != NULL && gethostname(host, sizeof(host)) == 0
+            && (xcb_get_property_value_length(machine) != strnlen(host, sizeof(host))
+                || memcmp(xcb_get_property_value(machine), host, strnlen(host, sizeof(host)))))
+        c->cpu = -1;
+    if (pid != NULL && pid->format == 32)
+        c->pid = *(uint32_t *)xcb_get_property_value(pid);
+    if (c->pid <= 1 || c->pid == getpid())
+        c->cpu = -1;
+
+    free(machine);
+    free(pid);
+}
+
+/* one-shot timer firing in ms milliseconds, 0 disarms it */
+void armtimer(int fd, long ms)
+{
+    struct itimerspec its = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000}};
+
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* insert c after the current client of the selected desktop and focus it */
+void attach(struct client *c)
+{
+    struct client *tmp;
 
     if (head == NULL) {
-        newclient->next = NULL;
-        newclient->prev = NULL;
-        head = newclient;
+        c->next = NULL;
+        c->prev = NULL;
+        head = c;
     } else {
         for (tmp = head; tmp->next; tmp = tmp->next)
             if (tmp == current)
                 break;
 
         if (tmp->next != NULL)
-            tmp->next->prev = newclient;
+            tmp->next->prev = c;
 
-        newclient->next = tmp->next;
-        newclient->prev = tmp;
+        c->next = tmp->next;
+        c->prev = tmp;
         
-        tmp->next = newclient;
+        tmp->next = c;
     }
 
-    update_title(newclient);
-
-    current = newclient;
+    current = c;
 }
 
 void buttonpress(XEvent *ev)
 {
-    if (ev->xbutton.subwindow != None) {
-        XGetWindowAttributes(dpy, ev->xbutton.subwindow, &attr);
+    struct client *c;
+
+    /* buttons are grabbed on the containers, so subwindow is a frame */
+    if ((c = frametoclient(ev->xbutton.subwindow))) {
+        attr.x = c->x;
+        attr.y = c->y;
+        attr.width = c->w;
+        attr.height = c->h;
         start = ev->xbutton;
+        dragged = c;
     }
 }
 
 void buttonrelease(XEvent *ev)
 {
-    start.subwindow = None;
+    /* motion may have been paced, so land exactly where the button went up */
+    if (dragged != NULL)
+        drag(ev->xbutton.x_root, ev->xbutton.y_root);
+    dragged = NULL;
+    dragpending = False;
+}
+
+/* append a record to the -R capture; stdio buffers it */
+void capture(unsigned int type, const void *data, unsigned int len)
+{
+    struct capturerec rec = {.type = type, .len = len};
+    unsigned long ns = monotonic();
+
+    if ((ns - capturens) / 1000 < UINT_MAX) {
+        rec.us = (ns - capturens) / 1000;
+        capturens += rec.us * 1000UL; /* no drift from the rounding */
+    } else {
+        rec.us = UINT_MAX;
+        capturens = ns;
+    }
+    fwrite(&rec, sizeof(rec), 1, capturefile);
+    if (len)
+        fwrite(data, len, 1, capturefile);
+    capturepending = (type != CaptureBatch);
+}
+
+/* -R: start a capture with our own windows and atoms, for replaywin() */
+void captureopen(const char *path)
+{
+    struct capturehead head = {CAPTURE_MAGIC, sizeof(long), AtomLast, root, barwin};
+
+    if (!(capturefile = fopen(path, "w"))) {
+        fprintf(stderr, "maxwelm: can't write %s\n", path);
+        exit(1);
+    }
+    memcpy(head.containers, containers, sizeof(containers));
+    memcpy(head.atoms, atoms, sizeof(atoms));
+    fwrite(&head, sizeof(head), 1, capturefile);
+    capturens = monotonic();
+}
+
+/* write max to the cpu.max of the cgroup v2 group of pid */
+int cgroupcpu(pid_t pid, const char *max)
+{
+    char path[600], cg[512], self[512], *p, *q;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+    if (readfile(path, cg, sizeof(cg)) < 0 || !(p = strstr(cg, "0::"))
+            || readfile("/proc/self/cgroup", self, sizeof(self)) < 0 || !(q = strstr(self, "0::")))
+        return -1;
+    p[3 + strcspn(p + 3, "\n")] = '\0';
+    q[3 + strcspn(q + 3, "\n")] = '\0';
+    /* a group shared with us would throttle maxwelm and all it started */
+    if (!strcmp(p, q))
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", p + 3);
+    if ((fd = open(path, O_WRONLY|O_CLOEXEC)) < 0)
+        return -1;
+    n = write(fd, max, strlen(max));
+    close(fd);
+    return n < 0 ? -1 : 0;
 }
 
 void change_desktop(const Arg arg)
 {
     int d = arg.i;
-    struct client *c;
 
-    if (d == currentdesktop)
+    if (d < 0 || d >= LENGTH(desktops) || d == currentdesktop)
         return;
+    TRACE(1, TraceDesktop, d, currentdesktop);
+
+    /* settle a focus change still pending on the desktop we leave */
+    if (dirty & DIRTY_FOCUS)
+        focus(current);
 
-    if (head != NULL)
-        for (c = head; c; c = c->next)
-            XUnmapWindow(dpy, c->win);
+    /* two requests however many clients either desktop holds; map the new
+     * container first so the root window never shows in between */
+    XMapWindow(dpy, containers[d]);
+    XUnmapWindow(dpy, containers[currentdesktop]);
 
     save_desktop(currentdesktop);
     
     select_desktop(d);
 
-    if (head != NULL)
-        for (c = head; c; c = c->next)
-            XMapWindow(dpy, c->win);
+    /* the old desktop keeps its current client lit for when we come back */
+    focused = NULL;
+    dirty |= DIRTY_FOCUS | DIRTY_BAR | DIRTY_THROTTLE;
+}
 
-    color_light = getcolor(focuscolors[currentdesktop]);
-    update_all_windows();
-    drawbar();
+/* only one client may select SubstructureRedirect on the root, see xerrorstart() */
+void checkotherwm()
+{
+    XSetErrorHandler(xerrorstart);
+    XSelectInput(dpy, DefaultRootWindow(dpy), SubstructureRedirectMask);
+    XSync(dpy, False);
+    roundtrips++;
+    XSetErrorHandler(xerror);
 }
 
 void cleanup()
 {
-    int i;
-    struct client *c;
-    fprintf(stdout, "\ncleanup!\n\tremoving all windows\n");
+    int i, n = 0;
+    struct client *c, **all;
+
+    if (capturefile)
+        fclose(capturefile);
+    if (replayfile)
+        fclose(replayfile);
+    capturefile = replayfile = NULL;
+    if (restarting)
+        savestate();
+
+    /* left mapped, with _NET_WM_DESKTOP, for the next window manager;
+     * bottom to top, so the root keeps their stacking for adopt() */
+    if ((all = calloc(MAX(clienthash_n, 1), sizeof(*all)))) {
+        for (i = 0; i < clienthash_size; i++)
+            for (c = clienthash[i]; c; c = c->hnext)
+                all[n++] = c;
+        qsort(all, n, sizeof(*all), stackcmp);
+        while (n > 0)
+            unmanage(all[--n], False);
+        free(all);
+    }
     for (i = 0; i < 10; i++) {
-        if (head != NULL)
-            for (c = head; c; c = c->next)
-                XUnmapWindow(dpy, c->win);
         save_desktop(currentdesktop);
         select_desktop(i);
-        fprintf(stdout, "\tcleaning desktop %d ...\n", i);
-        c = current;
-        while (c != NULL) {
-            remove_window(c->win);
-            XUnmapWindow(dpy, c->win);
-            update_all_windows();
-            c = current;
-        }
-        fprintf(stdout, "\tdone cleaning desktop %d\n", i);
+        while (current != NULL) /* only if calloc() failed */
+            unmanage(current, False);
         desktops[i].head = NULL;
         desktops[i].current = NULL;
     }
 
-    fprintf(stdout, "\n\tkilling status bar script\n");
-    const Arg killarg = {.com = killstatusbarcmd};
-    spawn(killarg);
+    if (STATUS_BAR_SCRIPT[0] != '\0') {
+        const Arg killarg = {.com = killstatusbarcmd};
+        spawn(killarg);
+    }
+
+    for (i = 0; i < CTL_CLIENTS; i++)
+        if (ctlclients[i].fd >= 0)
+            close(ctlclients[i].fd);
+    if (ctlfd >= 0) {
+        close(ctlfd);
+        unlink(ctlpath);
+    }
 
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
-	XFreeGC(dpy, gc);
+	XFreePixmap(dpy, barpix);
+	XDestroyWindow(dpy, barwin);
+	for (i = 0; i < LENGTH(containers); i++)
+		XDestroyWindow(dpy, containers[i]);
+	XFreeFont(dpy, font);
+	for (i = 0; i < LENGTH(gcs); i++)
+		XFreeGC(dpy, gcs[i]);
 	XSync(dpy, False);
 	XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
-    fprintf(stdout, "cleanup! done\n");
 }
 
 void client_to_desktop(const Arg arg)
@@ -250,43 +980,169 @@ void client_to_desktop(const Arg arg)
     struct client *movec = current;
     int orig_desktop = currentdesktop;
 
-    if (d == currentdesktop || current == NULL)
+    if (d < 0 || d >= LENGTH(desktops) || d == currentdesktop || current == NULL)
         return;
 
+    if (dirty & DIRTY_FOCUS)
+        focus(current);
+
+    detach(movec);
     save_desktop(orig_desktop);
     select_desktop(d);
-    add_window(movec->win);
+    if (current != NULL)
+        XSetWindowBorder(dpy, current->frame, colors[UNFOCUSED]);
+    attach(movec);
+    movec->desktop = d;
+    setdesktop(movec);
+    XSetWindowBorder(dpy, movec->frame, colors[d]);
     save_desktop(d);
 
     select_desktop(orig_desktop);
-    if (movec->win != None)
-        XUnmapWindow(dpy, movec->win);
-    remove_window(movec->win);
+    XReparentWindow(dpy, movec->frame, containers[d], movec->x, movec->y);
+    movec->stack = ++stackseq; /* reparenting stacks it on top */
 
-    update_all_windows();
-    drawbar();
+    focused = NULL;
+    dirty |= DIRTY_FOCUS | DIRTY_BAR | DIRTY_THROTTLE;
 }
 
-void close_win()
+/* a zeroed client from the pool, which grows a slab at a time */
+struct client *clientalloc()
 {
-    if (current != NULL) {
-		/* send delete signal to window */
-		XEvent ke;
-		ke.type = ClientMessage;
-		ke.xclient.window = current->win;
-		ke.xclient.message_type = XInternAtom(dpy, "WM_PROTOCOLS", True);
-		ke.xclient.format = 32;
-		ke.xclient.data.l[0] = XInternAtom(dpy, "WM_DELETE_WINDOW", True);
-		ke.xclient.data.l[1] = CurrentTime;
-		XSendEvent(dpy, current->win, False, NoEventMask, &ke);
-        send_kill_signal(current->win);
+    struct client *c;
+    int i;
+
+    if (clientpool == NULL) {
+        if (!(c = calloc(CLIENT_SLAB, sizeof(*c)))) {
+            fprintf(stderr, "calloc error!\n");
+            exit(1);
+        }
+        for (i = 0; i < CLIENT_SLAB; i++) {
+            c[i].next = clientpool;
+            clientpool = &c[i];
+        }
+        clientslabs++;
     }
+    c = clientpool;
+    clientpool = c->next;
+    memset(c, 0, sizeof(*c));
+    return c;
+}
+
+/* back to the pool, its title becomes garbage in the arena */
+void clientfree(struct client *c)
+{
+    titleset(c, NULL, 0);
+    free(c->states);
+    c->next = clientpool;
+    clientpool = c;
+}
+
+const char *clienttitle(struct client *c)
+{
+    return titles ? titles + c->title + sizeof(unsigned int) : "";
+}
+
+/* apply everything the last event batch changed, then flush once */
+void commit()
+{
+    /* keyboard geometry goes out paced like a drag, see motiontimer() */
+    if ((dirty & DIRTY_GEOM) && !motionarmed)
+        motiontimer();
+    if (dirty & DIRTY_FOCUS)
+        focus(current);
+    if (dirty & DIRTY_BAR)
+        drawbar();
+    if (CULL_OCCLUDED && (dirty & DIRTY_CULL))
+        cull();
+    if (THROTTLE_BACKGROUND && (dirty & DIRTY_THROTTLE))
+        throttle();
+    dirty = 0;
+    XFlush(dpy);
+}
+
+void close_win()
+{
+    if (current != NULL)
+        send_kill_signal(current->win); /* send delete signal to window */
+}
+
+/* the client did not move within its frame, tell it where it is on the
+ * screen (ICCCM 4.1.5) */
+void configure(struct client *c)
+{
+    XConfigureEvent ce;
+
+    ce.type = ConfigureNotify;
+    ce.display = dpy;
+    ce.event = c->win;
+    ce.window = c->win;
+    ce.x = c->x + c->bw;
+    ce.y = c->y + c->bw;
+    ce.width = c->w;
+    ce.height = c->h;
+    ce.border_width = 0;
+    ce.above = None;
+    ce.override_redirect = False;
+    XSendEvent(dpy, c->win, False, StructureNotifyMask, (XEvent *)&ce);
+}
+
+void configurenotify(XEvent *ev)
+{
+    struct client *c;
+    XConfigureEvent *cev = &ev->xconfigure;
+
+    /* events generated before our last configure are already superseded,
+     * and a pending keyboard move/resize is newer than anything reported */
+    if (!(c = wintoclient(cev->window)) || cev->serial < c->cfgserial || c == geompending)
+        return;
+
+    /* reported by the frame: the client sits at 0,0 in it, so only its
+     * size says anything about our cache */
+    c->w = cev->width;
+    c->h = cev->height;
 }
 
+/*
+ * A client we manage gets a new geometry only as far as its configrules[]
+ * policy allows, and at most CONFIGURE_BURST times a second; otherwise a
+ * synthetic ConfigureNotify tells it that it stays where it is. Windows
+ * we do not manage get what they ask for.
+ */
 void configurerequest(XEvent *e) {
-    /* Paste from dwm */
     XConfigureRequestEvent *ev = &e->xconfigurerequest;
     XWindowChanges wc;
+    struct client *c;
+    unsigned long now;
+    int x, y, w, h;
+
+    TRACE(2, TraceConfigure, ev->window, ev->value_mask);
+    /* a framed client is configured through its frame */
+    if ((c = wintoclient(ev->window))) {
+        x = ev->value_mask & CWX ? ev->x : c->x;
+        y = ev->value_mask & CWY ? ev->y : c->y;
+        w = ev->value_mask & CWWidth ? ev->width : c->w;
+        h = ev->value_mask & CWHeight ? ev->height : c->h;
+        if ((now = monotonic()) - c->cfgsince >= 1000000000UL) {
+            c->cfgsince = now;
+            c->cfgcount = 0;
+        }
+
+        if (x == c->x && y == c->y && w == c->w && h == c->h) {
+            cfgallowed++;
+            configure(c); /* nothing to do, but the client waits for an answer */
+        } else if (c->cfgpolicy == ConfigDeny || (c->cfgpolicy == ConfigMaxed && ismaxed(c))) {
+            cfgdenied++;
+            configure(c);
+        } else if (++c->cfgcount > CONFIGURE_BURST) {
+            cfgburst++;
+            configure(c);
+        } else {
+            cfgallowed++;
+            moveresize(c, x, y, w, h);
+        }
+        return;
+    }
+    cfgpassed++;
     wc.x = ev->x;
     wc.y = ev->y;
     wc.width = ev->width;
@@ -297,194 +1153,871 @@ void configurerequest(XEvent *e) {
     XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
 }
 
-void destroynotify(XEvent *ev)
+/*
+ * Take a new control connection into a free slot, or into one whose
+ * connection has not sent its line within CTL_TIMEOUT. Deadlines are only
+ * checked here, when a slot is wanted, so that poll() keeps sleeping.
+ */
+void ctlaccept()
 {
-    int i = 0;
-    struct client *c;
-    XDestroyWindowEvent *dstr = &ev->xdestroywindow;
-
-    for (c = head; c; c = c->next) {
-        if (dstr->window == c->win) {
-            i++;
-        }
-    }
+    unsigned long now;
+    int fd, i;
 
-    if (i == 0)
+    if ((fd = accept(ctlfd, NULL, NULL)) < 0)
         return;
-
-    remove_window(dstr->window);
-    update_all_titles();
-    update_all_windows();
-    drawbar();
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    now = monotonic();
+    for (i = 0; i < CTL_CLIENTS; i++)
+        if (ctlclients[i].fd < 0 || now - ctlclients[i].since >= CTL_TIMEOUT) {
+            if (ctlclients[i].fd >= 0)
+                close(ctlclients[i].fd); /* idle too long */
+            ctlclients[i].fd = fd;
+            ctlclients[i].len = 0;
+            ctlclients[i].since = now;
+            return;
+        }
+    close(fd); /* busy */
 }
 
-void drawbar()  
+void ctlinfo(int fd, const char *args)
 {
-    fprintf(stdout, "\n\tdrawbar->\n");
-
-    int status_w = strlen(status_text) * 6; /* right side of bar */
-    int bar_w = screen_w - status_w;        /* left side of bar */
-    
-    Window win = XCreateSimpleWindow(dpy, root, 0, 0, screen_w, TOPBAR, 0, color_light, color_light);
-    fprintf(stdout, "\t          create simple window\n");
-	XMapWindow(dpy, win);
-    fprintf(stdout, "\t          map window\n");
-	XDrawRectangle(dpy, win, setcolor(focuscolors[currentdesktop]), 0, 0, screen_w, TOPBAR - 1);
-    fprintf(stdout, "\t          draw rectangle\n");
-	XFillRectangle(dpy, win, setcolor(focuscolors[currentdesktop]), 0, 0, screen_w, TOPBAR);
-    fprintf(stdout, "\t          fill rectangle\n");
-
-    /* draw status text area */
-	XDrawRectangle(dpy, win, setcolor(UNFOCUS), screen_w - status_w, 0, status_w, TOPBAR - 1);
-    fprintf(stdout, "\t          draw rectangle\n");
-	XFillRectangle(dpy, win, setcolor(UNFOCUS), screen_w - status_w, 0, status_w, TOPBAR);
-    fprintf(stdout, "\t          fill rectangle\n");
-    XDrawString(dpy, win, setcolor(focuscolors[currentdesktop]), screen_w - status_w + 1, TOPBAR - 3, status_text, strlen(status_text));
-    fprintf(stdout, "\t          draw status text\n");
-    
-    /* load current window name */
-    if (current != NULL) {
-        update_title(current);
-        fprintf(stdout, "\n\t          update title\n");
-    }
+    struct client *c;
+    int n = 0, hidden = 0;
 
-    /* get count of open windows */
-    struct client *tmp;
-    int totalwin = 0;
-    int currentwin = 0;
-    for (tmp = head; tmp; tmp = tmp->next) {
-        totalwin = totalwin + 1;
-        if (tmp == current)
-            currentwin = totalwin;
+    for (c = head; c; c = c->next) {
+        n++;
+        hidden += c->hidden;
     }
-
-
-    char barbuffer[bar_w]; 
-
-    /* draw desktop number and window name */
-    snprintf(barbuffer, bar_w, "[D:%d|W:%d/%d] [%s]", currentdesktop, currentwin, totalwin, (current == NULL ? "" : current->name));
-    XDrawString(dpy, win, setcolor(UNFOCUS), 5, TOPBAR - 3, barbuffer, strlen(barbuffer));
-    fprintf(stdout, "\t          draw bar text\n");
-
-    fprintf(stdout, "\tdrawbar<-\n\n");
+    ctlreply(fd, "desktop %d\nwindows %d\nhidden %d\nfocused 0x%lx\ntitle %s\n",
+            currentdesktop, n, hidden, current ? current->win : None,
+            current ? clienttitle(current) : "");
 }
 
-unsigned long getcolor(const char* color)
+/* latency of every handler and key used so far; "latency reset" starts over */
+void ctllatency(int fd, const char *args)
 {
-    XColor c;
-    Colormap map = DefaultColormap(dpy, screen);
+    char name[64];
+    const char *sym;
+    int i;
 
-    if(!XAllocNamedColor(dpy, map, color, &c, &c)) {
-        fprintf(stderr, "Error parsing color!");
-        exit(1);
+    if (!strcmp(args, "reset")) {
+        memset(eventmetrics, 0, sizeof(eventmetrics));
+        memset(keymetrics, 0, sizeof(keymetrics));
+        memset(&commitmetric, 0, sizeof(commitmetric));
+        ctlreply(fd, "ok\n");
+        return;
     }
-
-    return c.pixel;
-}
-
-Bool gettextprop(Window w, Atom atom, char *text, unsigned int size) {
-	char **list = NULL;
-	int n;
-	XTextProperty name;
-
-	if (!text || size == 0)
-		return False;
-	text[0] = '\0';
-	XGetTextProperty(dpy, w, &name, atom);
-	if (!name.nitems)
-		return False;
-	if (name.encoding == XA_STRING) {
-		strncpy(text, (char *)name.value, size - 1);
-    } else {
-		if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list) {
-			strncpy(text, *list, size - 1);
-			XFreeStringList(list);
-		}
-	}
-	text[size - 1] = '\0';
-	XFree(name.value);
-	return True;
+    ctlreply(fd, "%-20s %8s %9s %9s %9s %7s %7s\n",
+            "name", "count", "p50 us", "p99 us", "max us", "req/op", "rt/op");
+    for (i = 0; i < LASTEvent; i++)
+        if (eventnames[i])
+            ctlmetric(fd, eventnames[i], &eventmetrics[i]);
+    for (i = 0; i < LENGTH(keys); i++) {
+        sym = XKeysymToString(keys[i].keysym);
+        snprintf(name, sizeof(name), "key %#x+%s", keys[i].mod, sym ? sym : "?");
+        ctlmetric(fd, name, &keymetrics[i]);
+    }
+    ctlmetric(fd, "commit", &commitmetric);
 }
 
-void grabinput() 
+/*
+ * Listen on CTL_SOCKET in $XDG_RUNTIME_DIR, or else in a directory of ours
+ * under /tmp. In /tmp itself anyone could take the name first.
+ */
+void ctllisten()
 {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char tmpdir[32];
+    struct stat st;
     int i;
-    KeyCode code;
 
-    for (i = 0; i < LENGTH(keys); ++i) {
-        if ((code = XKeysymToKeycode(dpy, keys[i].keysym))) {
-            XGrabKey(dpy, code, keys[i].mod, root, True, GrabModeAsync, GrabModeAsync);
+    for (i = 0; i < CTL_CLIENTS; i++)
+        ctlclients[i].fd = -1;
+
+    if (dir == NULL || dir[0] != '/') {
+        snprintf(tmpdir, sizeof(tmpdir), "/tmp/maxwelm-%u", (unsigned int)getuid());
+        mkdir(tmpdir, 0700);
+        /* made by someone else first, or open to others */
+        if (lstat(tmpdir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()
+                || (st.st_mode & 077)) {
+            fprintf(stderr, "Can't open control socket in %s\n", tmpdir);
+            return;
         }
+        dir = tmpdir;
+    }
+    if (snprintf(ctlpath, sizeof(ctlpath), "%s/" CTL_SOCKET, dir, DisplayString(dpy))
+            >= sizeof(ctlpath)) {
+        fprintf(stderr, "Can't open control socket in %s: path too long\n", dir);
+        ctlpath[0] = '\0';
+        return;
+    }
+    memcpy(sa.sun_path, ctlpath, sizeof(sa.sun_path)); /* snprintf() ended it */
+    unlink(ctlpath); /* left behind by an earlier instance */
+    if ((ctlfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0
+            || bind(ctlfd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+            || chmod(ctlpath, 0600) < 0
+            || listen(ctlfd, CTL_CLIENTS) < 0) {
+        fprintf(stderr, "Can't open control socket %s\n", ctlpath);
+        if (ctlfd >= 0)
+            close(ctlfd);
+        ctlfd = -1;
+        ctlpath[0] = '\0';
     }
-
-    XGrabButton(dpy, 1, MOD, root, True,
-            ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
-    XGrabButton(dpy, 3, MOD, root, True,
-            ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
 }
 
-
-void keypress(XEvent *ev)
+/* what the clients cost: the pool, the title arena and the index */
+void ctlmemory(int fd, const char *args)
 {
-    KeySym keysym = XkbKeycodeToKeysym(dpy, ev->xkey.keycode, 0, 0);
-    int i;
-    for (i = 0; i < LENGTH(keys); ++i) {
-        if (keys[i].keysym == keysym && keys[i].mod == ev->xkey.state) {
-            keys[i].function(keys[i].arg);
-            break;
-        }
-    }
+    unsigned long n = MAX(clienthash_n, 1);
+    unsigned long pool = clientslabs * CLIENT_SLAB * sizeof(struct client);
+    unsigned long index = clienthash_size * (sizeof(*clienthash) + sizeof(*framehash));
+
+    ctlreply(fd, "clients %u\n"
+            "pool %lu bytes, %u slabs of %d\n"
+            "titles %u bytes, %u replaced, %u allocated\n"
+            "index %lu bytes, %u buckets\n"
+            "per client %lu bytes: struct %lu, title %lu, index %lu\n",
+            clienthash_n,
+            pool, clientslabs, CLIENT_SLAB,
+            titles_len - titles_dead, titles_dead, titles_size,
+            index, clienthash_size,
+            (unsigned long)sizeof(struct client) + (titles_len - titles_dead) / n + index / n,
+            (unsigned long)sizeof(struct client), (titles_len - titles_dead) / n, index / n);
 }
 
-void maprequest(XEvent *ev)
+/* one line of ctllatency(), none for what never ran */
+void ctlmetric(int fd, const char *name, const struct metric *m)
 {
-    static XWindowAttributes wa;
-    XMapRequestEvent *mapev = &ev->xmaprequest;
-
-    if (!XGetWindowAttributes(dpy, mapev->window, &wa))
+    if (m->count == 0)
         return;
-    if (wa.override_redirect) /* for popups/dialogs */
-        return;
-
-    /* Map window and maximize, true to name */
-    XMapWindow(dpy, mapev->window);
-    add_window(mapev->window);
-    max_win();
-    update_all_titles();
-    update_all_windows();
-    drawbar();
+    ctlreply(fd, "%-20s %8lu %9.1f %9.1f %9.1f %7.1f %7.2f\n", name, m->count,
+            histpercentile(m, 50) / 1e3, histpercentile(m, 99) / 1e3, m->max / 1e3,
+            (double)m->requests / m->count, (double)m->roundtrips / m->count);
 }
 
-void max_win()
+/*
+ * Buffer what control connection i sent until a whole "command [argument]"
+ * line or the end of input is there, then run it and hang up.
+ */
+void ctlread(int i)
 {
-    if (current != NULL && current->win != None) {
-        static XWindowAttributes wa;
-        XGetWindowAttributes(dpy, current->win, &wa);
-        if (wa.width == maxwin_w && wa.height == maxwin_h
-                && wa.x == 0 && wa.y == TOPBAR) {
-            XMoveResizeWindow(dpy, current->win, current->old_x, 
-                    current->old_y, current->old_w, current->old_h);
+    struct ctlconn *cc = &ctlclients[i];
+    char *buf = cc->buf, *args;
+    ssize_t n;
+    int j;
+
+    n = read(cc->fd, buf + cc->len, sizeof(cc->buf) - 1 - cc->len);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n > 0) {
+        cc->len += n;
+        buf[cc->len] = '\0';
+        if (!strpbrk(buf, "\r\n")) {
+            if (cc->len < sizeof(cc->buf) - 1)
+                return; /* the rest is still on its way */
+            ctlreply(cc->fd, "error: line too long\n");
+            cc->len = 0;
+        }
+    } else if (n < 0) {
+        cc->len = 0; /* the reader went away */
+    }
+    if (cc->len > 0) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if ((args = strchr(buf, ' ')))
+            *args++ = '\0';
+        else
+            args = "";
+
+        for (j = 0; j < LENGTH(commands); j++)
+            if (!strcmp(buf, commands[j].name))
+                break;
+        if (j == LENGTH(commands)) {
+            ctlreply(cc->fd, "error: unknown command '%s'\n", buf);
+        } else if (commands[j].query) {
+            commands[j].query(cc->fd, args);
         } else {
-            current->old_x = wa.x;
-            current->old_y = wa.y;
-            current->old_w = wa.width;
-            current->old_h = wa.height;
-            XMoveResizeWindow(dpy, current->win, 0, TOPBAR, maxwin_w, maxwin_h);
+            const Arg arg = {.i = atoi(args)};
+            commands[j].action(arg);
+            ctlreply(cc->fd, "ok\n");
         }
     }
+    close(cc->fd);
+    cc->fd = -1;
+}
+
+void ctlreply(int fd, const char *fmt, ...)
+{
+    char buf[4096];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    /* never block on, or die from, a reader that went away */
+    if (send(fd, buf, MIN(n, sizeof(buf) - 1), MSG_NOSIGNAL|MSG_DONTWAIT) < 0 && errno == ENOTSOCK)
+        write(fd, buf, MIN(n, sizeof(buf) - 1)); /* stderr, from replayend() */
+}
+
+/* what maxwelm asked of the X server so far, bench/ reports the deltas */
+void ctlstats(int fd, const char *args)
+{
+    ctlreply(fd, "events %lu\nrequests %lu\nroundtrips %lu\n"
+            "focuschanges %lu\nfocusreqs %lu\ncolorallocs %lu\n"
+            "cfgallowed %lu\ncfgdenied %lu\ncfgburst %lu\ncfgpassed %lu\n",
+            events, NextRequest(dpy) - 1 + xcbsent, roundtrips,
+            focuschanges, focusreqs, colorallocs,
+            cfgallowed, cfgdenied, cfgburst, cfgpassed);
+}
+
+/* like xsetroot -name, without a round trip through the root window */
+void ctlstatus(int fd, const char *args)
+{
+    statusstop();
+    strncpy(status_text, args, sizeof(status_text) - 1);
+    dirty |= DIRTY_BAR;
+    ctlreply(fd, "ok\n");
+}
+
+/* the last n entries of the trace ring, oldest first, 64 by default */
+void ctltrace(int fd, const char *args)
+{
+    char buf[4096];
+    unsigned long i, n = args[0] ? strtoul(args, NULL, 10) : 64;
+    int len = 0;
+
+    if (TRACE_LEVEL == 0) {
+        ctlreply(fd, "error: tracing is compiled out, see TRACE_LEVEL\n");
+        return;
+    }
+    n = MIN(n, MIN(tracepos, TRACE_SIZE));
+    for (i = tracepos - n; i < tracepos; i++) {
+        len += tracefmt(buf + len, &tracering[i & (TRACE_SIZE - 1)]);
+        if (len > sizeof(buf) - 128 || i + 1 == tracepos) {
+            buf[len] = '\0';
+            ctlreply(fd, "%s", buf);
+            len = 0;
+        }
+    }
+}
+
+/*
+ * Unmap the frames of the selected desktop that the bar and the frames
+ * stacked above them cover completely, and map them back as soon as any
+ * part would show. Walking the desktop top to bottom, a frame is hidden
+ * when it lies inside the region covered so far.
+ */
+void cull()
+{
+    struct client *c;
+    Region covered;
+    XRectangle r = {0, 0, screen_w, TOPBAR};
+    unsigned int i, n = 0;
+
+    for (c = head; c; c = c->next)
+        n++;
+    if (n > stackbuf_size) {
+        stackbuf_size = n * 2;
+        if (!(stackbuf = realloc(stackbuf, stackbuf_size * sizeof(*stackbuf)))) {
+            fprintf(stderr, "realloc error!\n");
+            exit(1);
+        }
+    }
+    for (n = 0, c = head; c; c = c->next)
+        stackbuf[n++] = c;
+    qsort(stackbuf, n, sizeof(*stackbuf), stackcmp);
+
+    covered = XCreateRegion();
+    XUnionRectWithRegion(&r, covered, covered);
+    for (i = 0; i < n; i++) {
+        c = stackbuf[i];
+        if ((XRectInRegion(covered, c->x, c->y, c->w + 2 * c->bw, c->h + 2 * c->bw)
+                    == RectangleIn) != c->hidden)
+            sethidden(c, !c->hidden);
+        r.x = c->x;
+        r.y = c->y;
+        r.width = c->w + 2 * c->bw;
+        r.height = c->h + 2 * c->bw;
+        XUnionRectWithRegion(&r, covered, covered);
+    }
+    XDestroyRegion(covered);
+}
+
+void destroynotify(XEvent *ev)
+{
+    struct client *c;
+    XDestroyWindowEvent *dstr = &ev->xdestroywindow;
+
+    if ((c = wintoclient(dstr->window)))
+        unmanage(c, True);
+}
+
+/* unlink c from the selected desktop, focusing a neighbour */
+void detach(struct client *c)
+{
+    if (c->prev == NULL && c->next == NULL) {
+        head = NULL;
+        current = NULL;
+    } else if (c->prev == NULL) {
+        head = c->next;
+        c->next->prev = NULL;
+        current = c->next;
+    } else if (c->next == NULL) {
+        c->prev->next = NULL;
+        current = c->prev;
+    } else {
+        c->prev->next = c->next;
+        c->next->prev = c->prev;
+        current = c->prev;
+    }
+}
+
+/* apply the interactive move/resize started in buttonpress() */
+void drag(int x_root, int y_root)
+{
+    int xdiff = x_root - start.x_root;
+    int ydiff = y_root - start.y_root;
+    int x = attr.x + (start.button==1 ? xdiff : 0);
+    int y = attr.y + (start.button==1 ? ydiff : 0);
+    int w = MAX(1, attr.width + (start.button==3 ? xdiff : 0));
+    int h = MAX(1, attr.height + (start.button==3 ? ydiff : 0));
+
+    if (dragged != NULL)
+        moveresize(dragged, x, y, w, h);
+}
+
+void drawbar()
+{
+    char desk[sizeof(bar_desk)];
+    char title[sizeof(bar_title)];
+    int desk_w, status_w;
+    int x0 = screen_w, x1 = 0;  /* span of the bar that changed */
+    Bool all = (bar_desktop != currentdesktop);
+
+    /* get count of open windows */
+    struct client *tmp;
+    int totalwin = 0;
+    int currentwin = 0;
+    for (tmp = head; tmp; tmp = tmp->next) {
+        totalwin = totalwin + 1;
+        if (tmp == current)
+            currentwin = totalwin;
+    }
+
+    snprintf(desk, sizeof(desk), "[D:%d|W:%d/%d] ", currentdesktop, currentwin, totalwin);
+    snprintf(title, sizeof(title), "[%s]", (current == NULL ? "" : clienttitle(current)));
+    desk_w = 5 + XTextWidth(font, desk, strlen(desk));
+    status_w = XTextWidth(font, status_text, strlen(status_text)); /* right side of bar */
+
+    /* desktop number and window count */
+    if (all || strcmp(desk, bar_desk)) {
+        XFillRectangle(dpy, barpix, gcs[currentdesktop], 0, 0, desk_w, TOPBAR);
+        XDrawString(dpy, barpix, gcs[UNFOCUSED], 5, TOPBAR - 3, desk, strlen(desk));
+        x0 = 0;
+        x1 = desk_w;
+    }
+
+    /* window name, between the counter and the status text */
+    if (all || desk_w != bar_desk_w || status_w != bar_status_w || strcmp(title, bar_title)) {
+        XFillRectangle(dpy, barpix, gcs[currentdesktop],
+                desk_w, 0, MAX(0, screen_w - status_w - desk_w), TOPBAR);
+        XDrawString(dpy, barpix, gcs[UNFOCUSED], desk_w, TOPBAR - 3, title, strlen(title));
+        x0 = MIN(x0, MIN(desk_w, bar_desk_w));
+        x1 = MAX(x1, screen_w - MIN(status_w, bar_status_w));
+    }
+
+    /* status text area */
+    if (all || status_w != bar_status_w || strcmp(status_text, bar_status)) {
+        XFillRectangle(dpy, barpix, gcs[UNFOCUSED], screen_w - status_w, 0, status_w, TOPBAR);
+        XDrawString(dpy, barpix, gcs[currentdesktop], screen_w - status_w + 1, TOPBAR - 3, status_text, strlen(status_text));
+        x0 = MIN(x0, screen_w - MAX(status_w, bar_status_w));
+        x1 = screen_w;
+    }
+
+    /* blit everything that changed in one go */
+    if (x0 < x1) {
+        XCopyArea(dpy, barpix, barwin, gcs[UNFOCUSED], x0, 0, x1 - x0, TOPBAR, x0, 0);
+        TRACE(2, TraceBar, x0, x1);
+    }
+
+    strcpy(bar_desk, desk);
+    strcpy(bar_title, title);
+    strcpy(bar_status, status_text);
+    bar_desk_w = desk_w;
+    bar_status_w = status_w;
+    bar_desktop = currentdesktop;
+}
+
+void expose(XEvent *ev)
+{
+    XExposeEvent *exev = &ev->xexpose;
+
+    if (exev->window == barwin)
+        XCopyArea(dpy, barpix, barwin, gcs[UNFOCUSED], exev->x, exev->y,
+                exev->width, exev->height, exev->x, exev->y);
+}
+
+/*
+ * Move the input focus and lit border from the focused client to c. Only
+ * those two clients are touched, so the cost does not depend on how many
+ * clients share the desktop.
+ */
+void focus(struct client *c)
+{
+    unsigned long serial = NextRequest(dpy);
+
+    TRACE(1, TraceFocus, c ? c->win : None, focused ? focused->win : None);
+    if (focused != NULL && focused != c)
+        XSetWindowBorder(dpy, focused->frame, colors[UNFOCUSED]);
+    if (c != NULL) {
+        /* cull() may have unmapped it, and only a viewable window takes
+         * the input focus */
+        if (c->hidden)
+            sethidden(c, False);
+        XSetWindowBorder(dpy, c->frame, colors[c->desktop]);
+        XSetInputFocus(dpy, c->win, RevertToParent, CurrentTime);
+        /* frames stack inside the containers, always below the bar */
+        XRaiseWindow(dpy, c->frame);
+        c->stack = ++stackseq;
+    }
+    focused = c;
+    dirty |= DIRTY_CULL;
+
+    focuschanges++;
+    focusreqs += NextRequest(dpy) - serial;
+}
+
+/* send the geometry queued by setgeom() */
+void flushgeom()
+{
+    struct client *c = geompending;
+
+    if (c != NULL)
+        moveresize(c, c->x, c->y, c->w, c->h);
+}
+
+void freeze(struct client *c, Bool frozen)
+{
+    char max[32];
+
+    c->frozen = frozen;
+    if (c->cpu == 0) {
+        kill(c->pid, frozen ? SIGSTOP : SIGCONT);
+        return;
+    }
+    if (frozen)
+        snprintf(max, sizeof(max), "%d 100000", c->cpu * 1000);
+    else
+        strcpy(max, "max 100000");
+    if (cgroupcpu(c->pid, max) < 0)
+        fprintf(stderr, "maxwelm: can't set cpu.max of pid %d\n", (int)c->pid);
+}
+
+struct client *frametoclient(Window frame)
+{
+    struct client *c;
+
+    if (clienthash_size == 0)
+        return NULL;
+    for (c = framehash[hash(frame)]; c; c = c->fnext)
+        if (c->frame == frame)
+            return c;
+    return NULL;
+}
+
+unsigned long getcolor(const char* color)
+{
+    XColor c;
+    Colormap map = DefaultColormap(dpy, screen);
+
+    colorallocs++;
+    if(!XAllocNamedColor(dpy, map, color, &c, &c)) {
+        fprintf(stderr, "Error parsing color!");
+        exit(1);
+    }
+
+    return c.pixel;
+}
+
+xcb_get_property_cookie_t getprop(Window w, Atom atom)
+{
+    xcb_get_property_cookie_t ck;
+
+    ck = xcb_get_property(xc, 0, w, atom, XCB_GET_PROPERTY_TYPE_ANY, 0, TITLE_MAX / 4);
+    xcbsent = ck.sequence;
+    return ck;
+}
+
+/* wait for the reply to ck, NULL if the window or property is gone */
+xcb_get_property_reply_t *getreply(xcb_get_property_cookie_t ck)
+{
+    xcb_generic_error_t *err = NULL;
+    xcb_get_property_reply_t *r;
+
+    replywait(ck.sequence);
+    r = xcb_get_property_reply(xc, ck, &err);
+
+    free(err);
+    if (r != NULL && (r->type == XCB_NONE || r->value_len == 0)) {
+        free(r);
+        r = NULL;
+    }
+    return r;
+}
+
+Bool gettextprop(xcb_get_property_cookie_t ck, char *text, unsigned int size) {
+	char **list = NULL;
+	int n;
+	XTextProperty name;
+	xcb_get_property_reply_t *r;
+
+	if (!text || size == 0)
+		return False;
+	text[0] = '\0';
+	if (!(r = getreply(ck)))
+		return False;
+	name.value = xcb_get_property_value(r);
+	name.encoding = r->type;
+	name.format = r->format;
+	name.nitems = r->value_len;
+	if (name.encoding == XA_STRING) {
+		strncpy(text, (char *)name.value, MIN(size - 1, xcb_get_property_value_length(r)));
+		text[MIN(size - 1, xcb_get_property_value_length(r))] = '\0';
+    } else {
+		if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list) {
+			strncpy(text, *list, size - 1);
+			XFreeStringList(list);
+		}
+	}
+	text[size - 1] = '\0';
+	free(r);
+	return True;
+}
+
+/*
+ * Grab every binding in keys[] and build keytable[] from it, so keypress()
+ * is a single table lookup. Bindings also fire with NumLock or CapsLock on.
+ */
+void grabinput() 
+{
+    int i, j, k, min, max, per;
+    KeyCode numlock = XKeysymToKeycode(dpy, XK_Num_Lock);
+    KeySym *syms;
+    XModifierKeymap *modmap;
+    unsigned int locks[] = {0, LockMask, 0, LockMask};
+
+    numlockmask = 0;
+    roundtrips += 2; /* modifier and keyboard mapping */
+    modmap = XGetModifierMapping(dpy);
+    for (i = 0; i < 8; i++)
+        for (j = 0; j < modmap->max_keypermod; j++)
+            if (modmap->modifiermap[i * modmap->max_keypermod + j] == numlock)
+                numlockmask = (1 << i);
+    XFreeModifiermap(modmap);
+    locks[2] |= numlockmask;
+    locks[3] |= numlockmask;
+
+    XUngrabKey(dpy, AnyKey, AnyModifier, root);
+    memset(keytable, 0, sizeof(keytable));
+
+    XDisplayKeycodes(dpy, &min, &max);
+    syms = XGetKeyboardMapping(dpy, min, max - min + 1, &per);
+    for (k = min; k <= max; k++)
+        for (i = 0; i < LENGTH(keys); ++i)
+            if (keys[i].keysym == syms[(k - min) * per]) {
+                keytable[k][CLEANMASK(keys[i].mod)] = i + 1;
+                for (j = 0; j < LENGTH(locks); j++)
+                    XGrabKey(dpy, k, keys[i].mod | locks[j], root, True, GrabModeAsync, GrabModeAsync);
+            }
+    XFree(syms);
+
+    for (i = 0; i < LENGTH(containers); i++) {
+        XUngrabButton(dpy, AnyButton, AnyModifier, containers[i]);
+        for (j = 0; j < LENGTH(locks); j++) {
+            XGrabButton(dpy, 1, MOD | locks[j], containers[i], True,
+                    ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
+            XGrabButton(dpy, 3, MOD | locks[j], containers[i], True,
+                    ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
+        }
+    }
+}
+
+/* run the handler of an event from the server or from a replay */
+void handle(XEvent *ev)
+{
+    struct sample s;
+
+    if (!handler[ev->type])
+        return;
+    if (capturefile && ev->type != MotionNotify)
+        capture(ev->type, ev, capturesizes[ev->type]);
+    sample(&s);
+    TRACE(2, TraceEvent, ev->type, ev->xany.window);
+    handler[ev->type](ev); /* call handler */
+    record(&eventmetrics[ev->type], &s);
+    /* motionnotify() coalesces a burst into ev, keep what it applied */
+    if (capturefile && ev->type == MotionNotify)
+        capture(ev->type, ev, capturesizes[ev->type]);
+}
+
+
+unsigned int hash(Window w)
+{
+    return hashxid(w) & (clienthash_size - 1);
+}
+
+/* log-linear bucket of a sample: exact below HIST_SUB, 25% wide above */
+unsigned int histbucket(unsigned long ns)
+{
+    int msb;
+
+    if (ns < HIST_SUB)
+        return ns;
+    msb = 8 * sizeof(ns) - 1 - __builtin_clzl(ns);
+    return (msb - 1) * HIST_SUB + ((ns >> (msb - 2)) & (HIST_SUB - 1));
+}
+
+/* upper bound of the bucket holding the pct-th percentile sample */
+unsigned long histpercentile(const struct metric *m, unsigned int pct)
+{
+    unsigned long seen = 0, want = (m->count * pct + 99) / 100;
+    unsigned int b;
+
+    for (b = 0; b < HIST_BUCKETS - 1; b++)
+        if ((seen += m->bucket[b]) >= want)
+            break;
+    b++; /* lowest value of the next bucket, less one */
+    if (b >= HIST_SUB)
+        return MIN(m->max, ((unsigned long)(HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1)) - 1);
+    return b - 1;
+}
+
+/* index c by its window and by its frame */
+void hashadd(struct client *c)
+{
+    struct client **old = clienthash, **oldframes = framehash, *tmp;
+    unsigned int i, oldsize = clienthash_size;
+
+    /* keep the load factor at or below one */
+    if (clienthash_n + 1 > clienthash_size) {
+        clienthash_size = clienthash_size ? clienthash_size * 2 : 64;
+        if (!(clienthash = calloc(clienthash_size, sizeof(*clienthash)))
+                || !(framehash = calloc(clienthash_size, sizeof(*framehash)))) {
+            fprintf(stderr, "calloc error!\n");
+            exit(1);
+        }
+        for (i = 0; i < oldsize; i++) {
+            while ((tmp = old[i])) {
+                old[i] = tmp->hnext;
+                tmp->hnext = clienthash[hash(tmp->win)];
+                clienthash[hash(tmp->win)] = tmp;
+            }
+            while ((tmp = oldframes[i])) {
+                oldframes[i] = tmp->fnext;
+                tmp->fnext = framehash[hash(tmp->frame)];
+                framehash[hash(tmp->frame)] = tmp;
+            }
+        }
+        free(old);
+        free(oldframes);
+    }
+
+    c->hnext = clienthash[hash(c->win)];
+    clienthash[hash(c->win)] = c;
+    c->fnext = framehash[hash(c->frame)];
+    framehash[hash(c->frame)] = c;
+    clienthash_n++;
+}
+
+/* XIDs of one X client differ only in their low bits, mix them up */
+unsigned int hashxid(Window w)
+{
+    unsigned int h = (unsigned int)w;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+void hashdel(struct client *c)
+{
+    struct client **pc;
+
+    for (pc = &framehash[hash(c->frame)]; *pc; pc = &(*pc)->fnext)
+        if (*pc == c) {
+            *pc = c->fnext;
+            break;
+        }
+    for (pc = &clienthash[hash(c->win)]; *pc; pc = &(*pc)->hnext)
+        if (*pc == c) {
+            *pc = c->hnext;
+            clienthash_n--;
+            return;
+        }
+}
+
+/* cache the states the window of c had when we took it, less ours, see putstates() */
+void initstates(struct client *c, xcb_get_property_cookie_t ck)
+{
+    xcb_get_property_reply_t *r;
+    uint32_t *v;
+    unsigned int i;
+
+    if (!(r = getreply(ck)))
+        return;
+    if (r->format == 32 && (c->states = calloc(r->value_len + 1, sizeof(*c->states)))) {
+        v = xcb_get_property_value(r);
+        for (i = 0; i < r->value_len; i++)
+            if (v[i] != atoms[NetWMStateHidden])
+                c->states[c->nstates++] = v[i];
+    }
+    free(r);
+}
+
+Bool ismaxed(struct client *c)
+{
+    return c->x == 0 && c->y == TOPBAR && c->w == maxwin_w && c->h == maxwin_h;
+}
+
+void keypress(XEvent *ev)
+{
+    unsigned int i = keytable[ev->xkey.keycode][CLEANMASK(ev->xkey.state)];
+
+    /* with detectable autorepeat a repeat is a press without a release */
+    keyrepeat = (ev->xkey.keycode == heldkey ? keyrepeat + 1 : 0);
+    heldkey = ev->xkey.keycode;
+
+    if (i) {
+        struct sample s;
+
+        sample(&s);
+        TRACE(1, TraceKey, i - 1, keys[i - 1].keysym);
+        keys[i - 1].function(keys[i - 1].arg);
+        record(&keymetrics[i - 1], &s);
+    }
+}
+
+void keyrelease(XEvent *ev)
+{
+    if (ev->xkey.keycode != heldkey)
+        return;
+    heldkey = 0;
+    keyrepeat = 0;
+
+    /* the repeats stopped, send the final geometry without waiting */
+    flushgeom();
+}
+
+/* the keyboard changed under us: new keycodes, or NumLock moved */
+void mappingnotify(XEvent *ev)
+{
+    XMappingEvent *mapev = &ev->xmapping;
+
+    XRefreshKeyboardMapping(mapev);
+    if (mapev->request == MappingKeyboard || mapev->request == MappingModifier)
+        grabinput();
+}
+
+void maprequest(XEvent *ev)
+{
+    static XWindowAttributes wa;
+    XMapRequestEvent *mapev = &ev->xmaprequest;
+    struct query q;
+
+    if (wintoclient(mapev->window)) { /* already framed */
+        XMapWindow(dpy, mapev->window);
+        return;
+    }
+
+    /* attributes, geometry and properties in a single round trip; new
+     * windows open on the selected desktop */
+    querysend(mapev->window, &q);
+    if (!queryrecv(&q, &wa, False))
+        return;
+
+    /* Frame, map and maximize, true to name */
+    add_window(mapev->window, &wa, &q);
+    max_win();
+    dirty |= DIRTY_FOCUS | DIRTY_BAR;
+}
+
+void max_win()
+{
+    struct client *c = current;
+
+    if (c != NULL && c->win != None) {
+        if (ismaxed(c)) {
+            moveresize(c, c->old_x, c->old_y, c->old_w, c->old_h);
+        } else {
+            c->old_x = c->x;
+            c->old_y = c->y;
+            c->old_w = c->w;
+            c->old_h = c->h;
+            moveresize(c, 0, TOPBAR, maxwin_w, maxwin_h);
+        }
+    }
+}
+
+/* nanoseconds, from the vDSO */
+unsigned long monotonic()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
 void motionnotify(XEvent *ev)
 {
-    if (start.subwindow != None) {
-        int xdiff = ev->xbutton.x_root - start.x_root;
-        int ydiff = ev->xbutton.y_root - start.y_root;
+    if (dragged != NULL) {
+        /* coalesce: only the newest pointer position matters; a replay
+         * has done so already, see handle() */
+        while (!replayfile && XCheckTypedEvent(dpy, MotionNotify, ev));
+
+        drag_x = ev->xmotion.x_root;
+        drag_y = ev->xmotion.y_root;
+        dragpending = True;
+
+        /* pace configures to what the client can repaint */
+        if (!motionarmed)
+            motiontimer();
+    }
+}
+
+/*
+ * Apply the newest drag position and any queued keyboard geometry at most
+ * once per 1 / MOTION_HZ seconds.
+ */
+void motiontimer()
+{
+    uint64_t expirations;
+    Bool applied = False;
 
-        XMoveResizeWindow(dpy, start.subwindow,
-            attr.x + (start.button==1 ? xdiff : 0),
-            attr.y + (start.button==1 ? ydiff : 0),
-            MAX(1, attr.width + (start.button==3 ? xdiff : 0)),
-            MAX(1, attr.height + (start.button==3 ? ydiff : 0)));
+    if (motionarmed)
+        read(motionfd, &expirations, sizeof(expirations));
+
+    if (dragpending && dragged != NULL) {
+        drag(drag_x, drag_y);
+        applied = True;
+    }
+    dragpending = False;
+    if (geompending != NULL) {
+        flushgeom();
+        applied = True;
+    }
+
+    if (applied) {
+        armtimer(motionfd, 1000 / MOTION_HZ);
+        motionarmed = True;
+    } else {
+        /* the pointer and keys stopped, go idle until they move again */
+        armtimer(motionfd, 0);
+        motionarmed = False;
     }
 }
 
@@ -492,33 +2025,52 @@ void move_win(const Arg arg)
 {
     static int x, y;
     enum direction dir = arg.dir;
+    /* holding the key down speeds the window up */
+    int step = RESIZER * MIN(1 + keyrepeat / ACCEL_REPEATS, ACCEL_MAX);
+
+    struct client *c = current;
 
-    if (current != NULL && current->win != None) {
-        XGetWindowAttributes(dpy, current->win, &attr);
+    if (c != NULL && c->win != None) {
         switch (dir) {
         case LEFT:
-            x = MAX(1, attr.x - RESIZER);
-            y = attr.y;
+            x = MAX(1, c->x - step);
+            y = c->y;
             break;
         case DOWN:
-            x = attr.x;
-            y = (screen_h - attr.height < attr.y + RESIZER ? screen_h - attr.height : attr.y + RESIZER);
+            x = c->x;
+            y = (screen_h - c->h < c->y + step ? screen_h - c->h : c->y + step);
             break;
         case UP:
-            x = attr.x;
-            y = MAX(TOPBAR, attr.y - RESIZER);
+            x = c->x;
+            y = MAX(TOPBAR, c->y - step);
             break;
         case RIGHT:
-            x = (screen_w - attr.width < attr.x + RESIZER ? screen_w - attr.width : attr.x + RESIZER);
-            y = attr.y;
+            x = (screen_w - c->w < c->x + step ? screen_w - c->w : c->x + step);
+            y = c->y;
             break;
         default:
             break;
         }
-        XMoveWindow(dpy, current->win, x, y);
+        setgeom(c, x, y, c->w, c->h);
     }
 }
 
+/* fire-and-forget configure of c that keeps the geometry cache current */
+void moveresize(struct client *c, int x, int y, int w, int h)
+{
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    c->cfgserial = NextRequest(dpy);
+    XMoveResizeWindow(dpy, c->frame, x, y, w, h);
+    XResizeWindow(dpy, c->win, w, h);
+    if (c == geompending)
+        geompending = NULL;
+    dirty |= DIRTY_CULL;
+    configure(c);
+}
+
 void next_win()
 {
     struct client *c; 
@@ -530,8 +2082,7 @@ void next_win()
             c = current->next;
 
         current = c;
-        update_all_windows();
-        drawbar();
+        dirty |= DIRTY_FOCUS | DIRTY_BAR;
     }
 }
 
@@ -546,58 +2097,374 @@ void prev_win()
             c = current->prev;
 
         current = c;
-        update_all_windows();
-        drawbar();
+        dirty |= DIRTY_FOCUS | DIRTY_BAR;
     }
 }
 
 void propertynotify(XEvent *ev)
 {
-    fprintf(stdout, "\nPropertyNotify\n");
     XPropertyEvent *propev = &ev->xproperty;
+    struct client *c;
 
     if ((propev->window == root) && (propev->atom == XA_WM_NAME)) {
-        fprintf(stdout, "\tupdate status\n");
+        statusstop();
         update_status();
-        drawbar();
-    } else if (propev->state == PropertyDelete) {
-        return; /*ignore*/
-    } 
+        dirty |= DIRTY_BAR;
+    } else if ((propev->atom == atoms[NetWMName] || propev->atom == XA_WM_NAME)
+            && (c = wintoclient(propev->window))) {
+        /* the only place a title is fetched, drawbar() uses the cached one */
+        update_title(c);
+        if (c == current)
+            dirty |= DIRTY_BAR;
+    }
+}
+
+/* drop the replies to q that nobody is going to read */
+/*
+ * Write the _NET_WM_STATE of c from the cache, plus HIDDEN if hidden.
+ * Clients change their states by ClientMessage once mapped, which we do
+ * not honour, so the cache stays true and nothing needs reading back.
+ */
+void putstates(struct client *c, Bool hidden)
+{
+    Atom *states = c->states ? c->states : &atoms[NetWMStateHidden];
+
+    if (hidden)
+        states[c->nstates] = atoms[NetWMStateHidden];
+    if (c->nstates + hidden == 0)
+        XDeleteProperty(dpy, c->win, atoms[NetWMState]);
+    else
+        XChangeProperty(dpy, c->win, atoms[NetWMState], XA_ATOM, 32, PropModeReplace,
+                (unsigned char *)states, c->nstates + hidden);
+}
+
+void querydiscard(struct query *q)
+{
+    int i;
+
+    for (i = 0; i < QueryLast; i++)
+        if (q->prop[i].sequence)
+            xcb_discard_reply(xc, q->prop[i].sequence);
+}
+
+/*
+ * Wait for the attributes and geometry asked for by querysend(). Returns
+ * False, dropping the rest of q, for a window that is gone, has override
+ * redirect set (popups/dialogs) or, with viewable, is not on the screen.
+ */
+Bool queryrecv(struct query *q, XWindowAttributes *wa, Bool viewable)
+{
+    xcb_get_window_attributes_reply_t *ar;
+    xcb_get_geometry_reply_t *gr;
+    Bool manage;
+
+    replywait(q->attr.sequence);
+    ar = xcb_get_window_attributes_reply(xc, q->attr, NULL);
+    gr = xcb_get_geometry_reply(xc, q->geom, NULL);
+    manage = (ar != NULL && gr != NULL && !ar->override_redirect
+            && (!viewable || ar->map_state == XCB_MAP_STATE_VIEWABLE));
+    if (manage) {
+        wa->x = gr->x;
+        wa->y = gr->y;
+        wa->width = gr->width;
+        wa->height = gr->height;
+        wa->border_width = gr->border_width;
+    } else {
+        querydiscard(q);
+    }
+    free(ar);
+    free(gr);
+    return manage;
+}
+
+/* ask for everything about w at once, nothing waits for the replies here */
+void querysend(Window w, struct query *q)
+{
+    memset(q, 0, sizeof(*q));
+    q->attr = xcb_get_window_attributes(xc, w);
+    q->geom = xcb_get_geometry(xc, w);
+    q->prop[QueryNetWMName] = getprop(w, atoms[NetWMName]);
+    q->prop[QueryWMName] = getprop(w, XA_WM_NAME);
+    q->prop[QueryClass] = getprop(w, XA_WM_CLASS);
+    q->prop[QueryState] = getprop(w, atoms[NetWMState]);
+    if (THROTTLE_BACKGROUND) {
+        q->prop[QueryMachine] = getprop(w, XA_WM_CLIENT_MACHINE);
+        q->prop[QueryPid] = getprop(w, atoms[NetWMPid]);
+    }
 }
 
 void quit_wm()
 {
     running = False;
-    fprintf(stdout, "\nquitting maxwelm...\n");
+}
+
+/* read (the start of) a /proc or /sys file into buf, minus a final newline */
+int readfile(const char *path, char *buf, size_t size)
+{
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    if (n > 0 && buf[n - 1] == '\n')
+        n--;
+    buf[n] = '\0';
+    return n;
+}
+
+/* account for a call that started at s */
+void record(struct metric *m, const struct sample *s)
+{
+    struct sample now;
+    unsigned long ns;
+
+    sample(&now);
+    ns = now.ns - s->ns;
+    m->count++;
+    m->requests += now.requests - s->requests;
+    m->roundtrips += now.roundtrips - s->roundtrips;
+    m->max = MAX(m->max, ns);
+    m->bucket[histbucket(ns)]++;
 }
 
 void remove_window(Window w)
 {
     struct client *c;
+    int d = currentdesktop;
 
-    for (c = head; c != NULL; c = c->next) {
-        if (c->win == w) {
-            if (c->prev == NULL && c->next == NULL) {
-                free(head);
-                head = NULL;
-                current = NULL;
-                return;
-            } else if (c->prev == NULL) {
-                head = c->next;
-                c->next->prev = NULL;
-                current = c->next;
-            } else if (c->next == NULL) {
-                c->prev->next = NULL;
-                current = c->prev;
-            } else {
-                c->prev->next = c->next;
-                c->next->prev = c->prev;
-                current = c->prev;
-            }
+    if (!(c = wintoclient(w)))
+        return;
+
+    /* the client may live on a desktop that is not selected */
+    if (c->desktop != d) {
+        save_desktop(d);
+        select_desktop(c->desktop);
+    }
+    detach(c);
+    if (c->desktop != d) {
+        save_desktop(c->desktop);
+        select_desktop(d);
+    }
+    hashdel(c);
+    if (c == focused)
+        focused = NULL;
+    if (c == geompending)
+        geompending = NULL;
+    if (c == dragged)
+        dragged = NULL;
+    clientfree(c);
+}
 
-            free(c);
+/*
+ * Feed the handlers the captured events up to the end of the next batch,
+ * as the server once did, or only those due so far with -t. Events from
+ * the server itself are dropped meanwhile, see run().
+ */
+void replaybatch()
+{
+    Window *pair = (Window *)replaybuf;
+    struct client *c;
+    unsigned int type;
+    XEvent ev;
+
+    while (running) {
+        if (replayrealtime && monotonic() < replaydue)
+            return;
+        type = replayrec.type;
+        if (type == CaptureFrame && replayrec.len == 2 * sizeof(Window)) {
+            if ((c = wintoclient(replaywin(pair[0], False))))
+                replaymap(pair[1], c->frame);
+        } else if (type != CaptureBatch && type < LASTEvent
+                && capturesizes[type] && replayrec.len == capturesizes[type]) {
+            memset(&ev, 0, sizeof(ev));
+            memcpy(&ev, replaybuf, replayrec.len);
+            replaytranslate(&ev);
+            replayed++;
+            handle(&ev);
+        }
+        if (!replayread()) {
+            replayend();
             return;
         }
+        if (type == CaptureBatch)
+            return;
+    }
+}
+
+/* the capture is used up: report throughput and latency, then quit */
+void replayend()
+{
+    double secs = (monotonic() - replaystart) / 1e9;
+
+    fprintf(stderr, "maxwelm: replayed %lu events in %.3f s, %.0f events/s\n",
+            replayed, secs, secs > 0 ? replayed / secs : 0);
+    ctllatency(STDERR_FILENO, "");
+    fclose(replayfile);
+    replayfile = NULL;
+    running = False;
+}
+
+void replaymap(Window from, Window to)
+{
+    struct xidmap *old = replayxids;
+    unsigned int i, oldsize = replayxids_size;
+
+    if (2 * (replayxids_n + 1) > replayxids_size) {
+        replayxids_size = replayxids_size ? replayxids_size * 2 : 64;
+        if (!(replayxids = calloc(replayxids_size, sizeof(*replayxids)))) {
+            fprintf(stderr, "calloc error!\n");
+            exit(1);
+        }
+        replayxids_n = 0;
+        for (i = 0; i < oldsize; i++)
+            if (old[i].from)
+                replaymap(old[i].from, old[i].to);
+        free(old);
+    }
+
+    for (i = hashxid(from) & (replayxids_size - 1);
+            replayxids[i].from && replayxids[i].from != from; i = (i + 1) & (replayxids_size - 1))
+        ;
+    replayxids_n += !replayxids[i].from;
+    replayxids[i].from = from;
+    replayxids[i].to = to;
+}
+
+/* -P: replay a capture instead of handling the events of the server */
+void replayopen(const char *path)
+{
+    int i;
+
+    if (!(replayfile = fopen(path, "r"))
+            || fread(&replayhead, sizeof(replayhead), 1, replayfile) != 1
+            || memcmp(replayhead.magic, CAPTURE_MAGIC, sizeof(replayhead.magic))
+            || replayhead.word != sizeof(long) || replayhead.natoms != AtomLast) {
+        fprintf(stderr, "maxwelm: %s is not a capture this maxwelm can replay\n", path);
+        exit(1);
+    }
+    replaymap(replayhead.root, root);
+    replaymap(replayhead.bar, barwin);
+    for (i = 0; i < LENGTH(containers); i++)
+        replaymap(replayhead.containers[i], containers[i]);
+    replaystart = replaydue = monotonic();
+    if (!replayread())
+        replayend();
+}
+
+/* read ahead the next record, False at the end of the capture */
+Bool replayread()
+{
+    if (fread(&replayrec, sizeof(replayrec), 1, replayfile) != 1
+            || replayrec.len > sizeof(replaybuf)
+            || (replayrec.len && fread(replaybuf, replayrec.len, 1, replayfile) != 1))
+        return False;
+    replaydue += replayrec.us * 1000UL;
+    return True;
+}
+
+/* point a captured event at the windows and atoms of this session */
+void replaytranslate(XEvent *ev)
+{
+    int i;
+
+    ev->xany.display = dpy;
+    switch (ev->type) {
+    case KeyPress:
+    case KeyRelease:
+    case ButtonPress:
+    case ButtonRelease:
+    case MotionNotify: /* all laid out alike up to subwindow */
+        ev->xkey.window = replaywin(ev->xkey.window, False);
+        ev->xkey.root = root;
+        ev->xkey.subwindow = replaywin(ev->xkey.subwindow, False);
+        break;
+    case ConfigureNotify:
+        ev->xconfigure.event = replaywin(ev->xconfigure.event, False);
+        ev->xconfigure.window = replaywin(ev->xconfigure.window, False);
+        ev->xconfigure.above = replaywin(ev->xconfigure.above, False);
+        break;
+    case ConfigureRequest:
+        ev->xconfigurerequest.parent = replaywin(ev->xconfigurerequest.parent, False);
+        ev->xconfigurerequest.window = replaywin(ev->xconfigurerequest.window, True);
+        ev->xconfigurerequest.above = replaywin(ev->xconfigurerequest.above, False);
+        break;
+    case DestroyNotify:
+        ev->xdestroywindow.event = replaywin(ev->xdestroywindow.event, False);
+        ev->xdestroywindow.window = replaywin(ev->xdestroywindow.window, False);
+        break;
+    case Expose:
+        ev->xexpose.window = replaywin(ev->xexpose.window, False);
+        break;
+    case MapRequest:
+        ev->xmaprequest.parent = replaywin(ev->xmaprequest.parent, False);
+        ev->xmaprequest.window = replaywin(ev->xmaprequest.window, True);
+        break;
+    case PropertyNotify:
+        ev->xproperty.window = replaywin(ev->xproperty.window, False);
+        for (i = 0; i < AtomLast && ev->xproperty.atom != replayhead.atoms[i]; i++)
+            ;
+        if (i < AtomLast)
+            ev->xproperty.atom = atoms[i];
+        else if (ev->xproperty.atom > XA_LAST_PREDEFINED)
+            ev->xproperty.atom = None;
+        break;
+    case UnmapNotify:
+        ev->xunmap.event = replaywin(ev->xunmap.event, False);
+        ev->xunmap.window = replaywin(ev->xunmap.window, False);
+        break;
+    }
+}
+
+/* poll() timeout while replaying: none, or until the next record is due */
+int replaywait()
+{
+    unsigned long now = monotonic();
+
+    return !replayrealtime || now >= replaydue ? 0 : (replaydue - now) / 1000000 + 1;
+}
+
+/*
+ * This session's window for captured window w. A client window seen for
+ * the first time, with create, gets an unmapped stand-in of our own for
+ * the handlers to manage; anything else unknown becomes None.
+ */
+Window replaywin(Window w, Bool create)
+{
+    unsigned int i;
+    char name[32];
+    Window to;
+
+    if (w == None)
+        return None;
+    for (i = hashxid(w) & (replayxids_size - 1); replayxids[i].from; i = (i + 1) & (replayxids_size - 1))
+        if (replayxids[i].from == w)
+            return replayxids[i].to;
+    if (!create)
+        return None;
+    to = XCreateSimpleWindow(dpy, root, 0, 0, 640, 480, 0, 0, 0);
+    snprintf(name, sizeof(name), "replay 0x%lx", w);
+    XStoreName(dpy, to, name);
+    /* the handler queries it on xc next, see main() */
+    XSync(dpy, False);
+    roundtrips++;
+    replaymap(w, to);
+    return to;
+}
+
+/*
+ * Count the round trip that waiting for the reply to request seq on xc
+ * costs. None if seq went out before the last reply we waited for: the
+ * server answered it in the same trip.
+ */
+void replywait(unsigned int seq)
+{
+    if (seq > xcbwaited) {
+        roundtrips++;
+        xcbwaited = xcbsent;
     }
 }
 
@@ -605,45 +2472,115 @@ void resize_win(const Arg arg)
 {
     static int w, h;
     enum direction dir = arg.dir;
+    /* holding the key down speeds the window up */
+    int step = RESIZER * MIN(1 + keyrepeat / ACCEL_REPEATS, ACCEL_MAX);
 
-    if (current != NULL && current->win != None) {
-        XGetWindowAttributes(dpy, current->win, &attr);
+    struct client *c = current;
+
+    if (c != NULL && c->win != None) {
         switch (dir) {
         case LEFT:
-            w = MAX(1, attr.width - RESIZER);
-            h = attr.height;
+            w = MAX(1, c->w - step);
+            h = c->h;
             break;
         case DOWN:
-            w = attr.width;
-            h = (screen_h - attr.y < attr.height + RESIZER ? screen_h - attr.y : attr.height + RESIZER);
+            w = c->w;
+            h = (screen_h - c->y < c->h + step ? screen_h - c->y : c->h + step);
             break;
         case UP:
-            w = attr.width;
-            h = MAX(1, attr.height - RESIZER);
+            w = c->w;
+            h = MAX(1, c->h - step);
             break;
         case RIGHT:
-            w = (screen_w - attr.x < attr.width + RESIZER ? screen_w - attr.x : attr.width + RESIZER);
-            h = attr.height;
+            w = (screen_w - c->x < c->w + step ? screen_w - c->x : c->w + step);
+            h = c->h;
             break;
         default:
             break;
         }
-        XResizeWindow(dpy, current->win, w, h);
+        setgeom(c, c->x, c->y, w, h);
     }
 }
 
+/* quit, then exec the maxwelm binary again with the layout kept */
+void restart_wm()
+{
+    if (capturefile || replayfile) /* the capture would start over */
+        return;
+    restarting = True;
+    running = False;
+}
+
 void run()
 {
     XEvent ev;
-
-    start.subwindow = None;
+    struct pollfd pfd[PollLast + CTL_CLIENTS];
+    struct sample s;
+    int i;
 
 	XSync(dpy, False);
+    roundtrips++;
+
+    pfd[PollX].fd = ConnectionNumber(dpy);
+    pfd[PollSignal].fd = sigfd;
+    pfd[PollMotion].fd = motionfd;
+    pfd[PollStatus].fd = statusfd;
+    pfd[PollCtl].fd = ctlfd;
+
+    /* sleep in poll() until the X server, a signal, a timer or a control
+     * connection has something for us, never waking up otherwise */
+    while (running) {
+        for (i = 0; i < PollLast + CTL_CLIENTS; i++) {
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        for (i = 0; i < CTL_CLIENTS; i++)
+            pfd[PollLast + i].fd = ctlclients[i].fd;
+
+        /* XPending() flushes, and Xlib may already hold queued events */
+        if (!XPending(dpy) && poll(pfd, LENGTH(pfd), replayfile ? replaywait() : -1) < 0
+                && errno != EINTR) {
+            fprintf(stderr, "poll failed\n");
+            break;
+        }
+
+        /* Credit to dwm for the O(1)-time event loop; the whole batch is
+         * drained before touching the screen */
+        while (running && XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            events++;
+            if (!replayfile) /* a replay is driven by the capture alone */
+                handle(&ev);
+        }
+        if (replayfile)
+            replaybatch();
+
+        if (pfd[PollSignal].revents & POLLIN)
+            signalread();
+        if (pfd[PollMotion].revents & POLLIN)
+            motiontimer();
+        if (pfd[PollStatus].revents & POLLIN)
+            statustimer();
+        if (pfd[PollCtl].revents & POLLIN)
+            ctlaccept();
+        for (i = 0; i < CTL_CLIENTS; i++)
+            if (pfd[PollLast + i].revents && ctlclients[i].fd == pfd[PollLast + i].fd)
+                ctlread(i);
+
+        if (capturepending)
+            capture(CaptureBatch, NULL, 0);
+        sample(&s);
+        commit();
+        record(&commitmetric, &s);
+    }
+}
 
-	/* Credit to dwm for the O(1)-time event loop */
-	while (running && !XNextEvent(dpy, &ev))
-		if (handler[ev.type])
-			handler[ev.type](&ev); /* call handler */
+/* a vDSO clock read and two counters, cheap enough for every event */
+void sample(struct sample *s)
+{
+    s->ns = tracens = monotonic();
+    s->requests = NextRequest(dpy) + xcbsent;
+    s->roundtrips = roundtrips;
 }
 
 void save_desktop(int d)
@@ -652,6 +2589,35 @@ void save_desktop(int d)
     desktops[d].current = current;
 }
 
+/*
+ * Leave the desktop lists for the next instance in _MAXWELM_STATE on the
+ * root: the selected desktop, then for every client in list order its
+ * window, desktop (with STATE_CURRENT) and saved geometry.
+ */
+void savestate()
+{
+    struct client *c;
+    long *state;
+    int d, n = 0;
+
+    save_desktop(currentdesktop);
+    if (!(state = calloc(1 + STATE_ENTRY * clienthash_n, sizeof(*state))))
+        return;
+    state[n++] = currentdesktop;
+    for (d = 0; d < LENGTH(desktops); d++)
+        for (c = desktops[d].head; c; c = c->next) {
+            state[n++] = c->win;
+            state[n++] = d | (c == desktops[d].current ? STATE_CURRENT : 0);
+            state[n++] = c->old_x;
+            state[n++] = c->old_y;
+            state[n++] = c->old_w;
+            state[n++] = c->old_h;
+        }
+    XChangeProperty(dpy, root, atoms[MaxwelmState], XA_CARDINAL, 32, PropModeReplace,
+            (unsigned char *)state, n);
+    free(state);
+}
+
 void select_desktop(int d)
 {
     head = desktops[d].head;
@@ -664,23 +2630,93 @@ void send_kill_signal(Window w)
     XEvent ke;
     ke.type = ClientMessage;
     ke.xclient.window = w;
-    ke.xclient.message_type = XInternAtom(dpy, "WM_PROTOCOLS", True);
+    ke.xclient.message_type = atoms[WMProtocols];
     ke.xclient.format = 32;
-    ke.xclient.data.l[0] = XInternAtom(dpy, "WM_DELETE_WINDOW", True);
+    ke.xclient.data.l[0] = atoms[WMDelete];
     ke.xclient.data.l[1] = CurrentTime;
     XSendEvent(dpy, w, False, NoEventMask, &ke);
 }
 
-GC setcolor(const char* col) 
+/* EWMH: tell pagers, and the next maxwelm after a restart, where c lives */
+void setdesktop(struct client *c)
 {
-	XAllocNamedColor(dpy, cmap, col, &color, &color);
-	XSetForeground(dpy, gc, color.pixel);
-	return gc;
+    long d = c->desktop;
+
+    XChangeProperty(dpy, c->win, atoms[NetWMDesktop], XA_CARDINAL, 32, PropModeReplace,
+            (unsigned char *)&d, 1);
+}
+
+/* update the cached geometry of c now, the configure follows in commit() */
+void setgeom(struct client *c, int x, int y, int w, int h)
+{
+    if (geompending != NULL && geompending != c)
+        flushgeom();
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    geompending = c;
+    dirty |= DIRTY_GEOM;
+}
+
+/* withdraw c from view while it is covered, toolkits see the EWMH hint */
+void sethidden(struct client *c, Bool hidden)
+{
+    c->hidden = hidden;
+    if (hidden) {
+        XUnmapWindow(dpy, c->frame);
+        putstates(c, True);
+    } else {
+        putstates(c, False);
+        XMapWindow(dpy, c->frame);
+    }
+}
+
+/* title of c from the replies to _NET_WM_NAME and WM_NAME, preferring the first */
+void settitle(struct client *c, xcb_get_property_cookie_t netname, xcb_get_property_cookie_t name)
+{
+    static const char broken[] = "broken";
+    char text[TITLE_MAX];
+
+	if (gettextprop(netname, text, sizeof text))
+		xcb_discard_reply(xc, name.sequence);
+	else
+		gettextprop(name, text, sizeof text);
+	if (text[0] == '\0') /* hack to mark broken Clients */
+		strcpy(text, broken);
+    titleset(c, text, strlen(text));
+    TRACE(2, TraceTitle, c->win, strlen(text));
 }
 
 void setup() 
 {
-    sigchld(0); 
+    int i;
+
+    /* signals are read from sigfd in run() instead of interrupting it */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0
+            || (motionfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Can't create signalfd/timerfd");
+        exit(1);
+    }
+	while (0 < waitpid(-1, NULL, WNOHANG));
+
+    /* a crash leaves the trace ring on stderr, from a stack of its own */
+    if (TRACE_LEVEL > 0) {
+        static const int fatal[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+        static char altstack[16384];
+        stack_t ss = {.ss_sp = altstack, .ss_size = sizeof(altstack)};
+        struct sigaction sa = {.sa_handler = tracecrash, .sa_flags = SA_RESETHAND|SA_ONSTACK};
+
+        sigaltstack(&ss, NULL);
+        for (i = 0; i < LENGTH(fatal); i++)
+            sigaction(fatal[i], &sa, NULL);
+    }
 
     screen = DefaultScreen(dpy);
     screen_w = XDisplayWidth(dpy, screen);
@@ -690,15 +2726,29 @@ void setup()
     maxwin_w = screen_w - (2 * WINBORDER);
     maxwin_h = screen_h - TOPBAR - (2 * WINBORDER);
 
+    XSetErrorHandler(xerror);
+
+    /* a container per desktop, created before the bar to stay below it;
+     * only the one of the selected desktop is mapped */
+    XSetWindowAttributes ca;
+    ca.override_redirect = True;
+    ca.background_pixmap = ParentRelative;
+    for (i = 0; i < LENGTH(containers); i++)
+        containers[i] = XCreateWindow(dpy, root, 0, 0, screen_w, screen_h, 0,
+                CopyFromParent, InputOutput, CopyFromParent,
+                CWOverrideRedirect|CWBackPixmap, &ca);
+
     grabinput();
+    XkbSetDetectableAutoRepeat(dpy, True, NULL);
+    roundtrips++;
 
     head = NULL;
     current = NULL;
 
-    /* EWMH */
-    NetWMName = XInternAtom(dpy, "_NET_WM_NAME", False);
+    /* ICCCM and EWMH atoms, one round trip for all of them */
+    XInternAtoms(dpy, (char **)atomnames, AtomLast, False, atoms);
+    roundtrips++;
 
-    int i;
     for (i = 0; i < 10; i++) {
         desktops[i].head = head;
         desktops[i].current = current;
@@ -708,41 +2758,75 @@ void setup()
     const Arg arg = {.i = 1};
     currentdesktop = arg.i;
     change_desktop(arg);
+    XMapWindow(dpy, containers[currentdesktop]);
 
-    /* init color stuff */
-    color_light = getcolor(focuscolors[currentdesktop]);
-    color_dark = getcolor(UNFOCUS);
-    cmap = DefaultColormap(dpy, screen);
+    /* init color stuff: resolve every color once, nothing allocates after this */
     XGCValues val;
-    val.font = XLoadFont(dpy, "fixed");
-    gc = XCreateGC(dpy, root, GCFont, &val);
+    font = XLoadQueryFont(dpy, "fixed");
+    val.font = font->fid;
+    for (i = 0; i < LENGTH(colors); i++) {
+        colors[i] = getcolor(i == UNFOCUSED ? UNFOCUS : focuscolors[i]);
+        val.foreground = colors[i];
+        gcs[i] = XCreateGC(dpy, root, GCFont|GCForeground, &val);
+    }
+
+    /* persistent bar window, painted through an offscreen pixmap */
+    XSetWindowAttributes wa;
+    wa.override_redirect = True;
+    wa.background_pixel = colors[currentdesktop];
+    wa.event_mask = ExposureMask;
+    barwin = XCreateWindow(dpy, root, 0, 0, screen_w, TOPBAR, 0,
+            DefaultDepth(dpy, screen), InputOutput, DefaultVisual(dpy, screen),
+            CWOverrideRedirect|CWBackPixel|CWEventMask, &wa);
+    barpix = XCreatePixmap(dpy, root, screen_w, TOPBAR, DefaultDepth(dpy, screen));
+    XMapWindow(dpy, barwin);
 
     /* init status bar text */
     strncpy(status_text, "maxwelm\0", sizeof(status_text));
-    const Arg statusarg = {.com = statusbarcmd};
-    spawn(statusarg);
+    if (STATUS_BAR_SCRIPT[0] != '\0') {
+        const Arg statusarg = {.com = statusbarcmd};
+        spawn(statusarg);
+    } else if ((statusfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC)) >= 0) {
+        statustimer();
+    }
 
     drawbar();
 
+    ctllisten();
+
     XSelectInput(dpy,root,SubstructureNotifyMask|SubstructureRedirectMask|PropertyChangeMask);
+
+    adopt();
 }
 
-/* Credit to dwm for this */
-void sigchld(int unused) 
+void signalread()
 {
-	if (signal(SIGCHLD, sigchld) == SIG_ERR) {
-		fprintf(stderr, "Can't install SIGCHLD handler");
-        exit(1);
+    struct signalfd_siginfo si;
+
+    while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD)
+            while (0 < waitpid(-1, NULL, WNOHANG)); /* Credit to dwm for this */
+        else
+            quit_wm();
     }
-	while (0 < waitpid(-1, NULL, WNOHANG));
 }
 
 void spawn(const Arg arg)
 {
+    if (replayfile) /* a replay starts no programs */
+        return;
     if (fork() == 0) {
         if (fork() == 0) {
+            sigset_t mask;
+
             if (dpy)
                 close(ConnectionNumber(dpy));
+            if (xc)
+                close(xcb_get_file_descriptor(xc));
+
+            /* setup() blocked these for sigfd, don't pass that on */
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
 
             setsid();
             execvp((char*)arg.com[0], (char**)arg.com);
@@ -751,66 +2835,439 @@ void spawn(const Arg arg)
     }
 }
 
-void update_all_titles()
+/* qsort() order for cull(): topmost first */
+int stackcmp(const void *a, const void *b)
 {
-    struct client *tmp;
-    tmp = head;
-    if (head == NULL)
+    unsigned long sa = (*(struct client **)a)->stack, sb = (*(struct client **)b)->stack;
+
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/* "BAT 57% " while running on battery */
+int status_battery(char *buf, size_t size, const char *arg)
+{
+    char path[300], val[32];
+    struct dirent *de;
+    DIR *dir;
+    int capacity = -1;
+    Bool online = False;
+
+    if (!(dir = opendir("/sys/class/power_supply")))
+        return 0;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "/sys/class/power_supply/%s/type", de->d_name);
+        if (readfile(path, val, sizeof(val)) < 0)
+            continue;
+        if (!strcmp(val, "Mains")) {
+            snprintf(path, sizeof(path), "/sys/class/power_supply/%s/online", de->d_name);
+            if (readfile(path, val, sizeof(val)) > 0 && val[0] == '1')
+                online = True;
+        } else if (!strcmp(val, "Battery") && capacity < 0) {
+            snprintf(path, sizeof(path), "/sys/class/power_supply/%s/capacity", de->d_name);
+            if (readfile(path, val, sizeof(val)) > 0)
+                capacity = atoi(val);
+        }
+    }
+    closedir(dir);
+
+    if (online || capacity < 0)
+        return 0;
+    return snprintf(buf, size, "BAT %d%% ", capacity);
+}
+
+int status_clock(char *buf, size_t size, const char *arg)
+{
+    char tmp[48];
+    time_t t = time(NULL);
+
+    if (!strftime(tmp, sizeof(tmp), arg, localtime(&t)))
+        return 0;
+    return snprintf(buf, size, "[%s]", tmp);
+}
+
+/* busy share of all CPU time since the previous call */
+int status_cpu(char *buf, size_t size, const char *arg)
+{
+    static unsigned long long lastbusy, lasttotal;
+    unsigned long long v[8] = {0}, busy, total;
+    char line[256];
+    int i, pct = 0;
+
+    if (readfile("/proc/stat", line, sizeof(line)) < 0
+            || sscanf(line, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4)
+        return 0;
+
+    for (total = 0, i = 0; i < 8; i++)
+        total += v[i];
+    busy = total - v[3] - v[4]; /* minus idle and iowait */
+    if (total > lasttotal)
+        pct = 100 * (busy - lastbusy) / (total - lasttotal);
+    lastbusy = busy;
+    lasttotal = total;
+    return snprintf(buf, size, "CPU[%d%%] ", pct);
+}
+
+/* "WIFI down! " while interface arg is not up */
+int status_net(char *buf, size_t size, const char *arg)
+{
+    char path[128], state[32];
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/operstate", arg);
+    if (readfile(path, state, sizeof(state)) < 0 || !strcmp(state, "up"))
+        return 0;
+    return snprintf(buf, size, "WIFI %s! ", state);
+}
+
+int status_ram(char *buf, size_t size, const char *arg)
+{
+    char data[2048], *p;
+    unsigned long total, avail;
+
+    if (readfile("/proc/meminfo", data, sizeof(data)) < 0
+            || !(p = strstr(data, "MemTotal:")) || sscanf(p, "MemTotal: %lu", &total) != 1
+            || !(p = strstr(data, "MemAvailable:")) || sscanf(p, "MemAvailable: %lu", &avail) != 1
+            || total == 0)
+        return 0;
+    return snprintf(buf, size, "RAM[%lu%%] ", 100 * (total - avail) / total);
+}
+
+/* xsetroot -name or the status command took over from the built-in segments */
+void statusstop()
+{
+    statusset = True;
+    if (statusfd >= 0)
+        armtimer(statusfd, 0);
+}
+
+/*
+ * Refresh the segments that are due and sleep until the next one is. Due
+ * times are aligned to multiples of each interval, so segments that share
+ * a deadline are refreshed in one wakeup and the clock turns on the minute.
+ */
+void statustimer()
+{
+    char text[sizeof(status_text)] = " ";
+    uint64_t expirations;
+    time_t now = time(NULL), next = 0;
+    int i;
+
+    read(statusfd, &expirations, sizeof(expirations));
+    if (statusset) /* fired in the batch that stopped it */
         return;
 
-    fprintf(stdout, "\n");
-    update_title(tmp);
-    while (tmp->next) {
-        fprintf(stdout, " -> ");
-        tmp = tmp->next;
-        update_title(tmp);
+    for (i = 0; i < LENGTH(segments); i++) {
+        struct segment *s = &segments[i];
+
+        if (s->due <= now) {
+            if (s->function(s->text, sizeof(s->text), s->arg) <= 0)
+                s->text[0] = '\0';
+            s->due = now - now % MAX(s->interval, 1) + MAX(s->interval, 1);
+        }
+        strncat(text, s->text, sizeof(text) - strlen(text) - 1);
+        if (next == 0 || s->due < next)
+            next = s->due;
     }
-    fprintf(stdout, "\n");
+
+    if (strcmp(text, status_text)) {
+        strcpy(status_text, text);
+        dirty |= DIRTY_BAR;
+    }
+
+    struct itimerspec its = {{0, 0}, {next, 0}};
+    timerfd_settime(statusfd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
-void update_all_windows()
+/*
+ * Stop or slow down the processes whose windows are all on hidden desktops,
+ * and resume the others. A process showing any window on the selected
+ * desktop keeps running at full speed.
+ */
+void throttle()
 {
+    struct client *c, *v;
+    unsigned int i;
+    Bool hide;
+
+    for (i = 0; i < clienthash_size; i++)
+        for (c = clienthash[i]; c; c = c->hnext) {
+            if (c->cpu < 0)
+                continue;
+            hide = (c->desktop != currentdesktop);
+            for (v = head; hide && v; v = v->next)
+                if (v->pid == c->pid)
+                    hide = False;
+            if (hide != c->frozen)
+                freeze(c, hide);
+        }
+}
+
+
+/* copy text to the end of titles[], which has room for it */
+unsigned int titleappend(const char *text, unsigned int len)
+{
+    unsigned int off = titles_len;
+
+    memcpy(titles + off, &len, sizeof(len));
+    memcpy(titles + off + sizeof(len), text, len);
+    titles[off + sizeof(len) + len] = '\0';
+    titles_len += TITLESIZE(len);
+    return off;
+}
+
+/* drop the replaced titles by moving the live ones to a fresh arena */
+void titlecompact()
+{
+    char *old = titles;
+    unsigned int i, len;
     struct client *c;
 
-    for (c = head; c; c = c->next) {
-        if (current == c) {
-            XSetWindowBorderWidth(dpy, c->win, 1);
-            XSetWindowBorder(dpy, c->win, color_light);
-            XSetInputFocus(dpy, c->win, RevertToParent, CurrentTime);
-            XRaiseWindow(dpy, c->win);
-        } else {
-            XSetWindowBorder(dpy, c->win, color_dark);
+    if (!(titles = malloc(titles_size))) {
+        fprintf(stderr, "malloc error!\n");
+        exit(1);
+    }
+    titles_len = 0;
+    titles_dead = 0;
+    titleappend("", 0);
+    for (i = 0; i < clienthash_size; i++)
+        for (c = clienthash[i]; c; c = c->hnext)
+            if (c->title != 0) {
+                memcpy(&len, old + c->title, sizeof(len));
+                c->title = titleappend(old + c->title + sizeof(len), len);
+            }
+    free(old);
+}
+
+/* make text the title of c; the old one stays in the arena until compacted */
+void titleset(struct client *c, const char *text, unsigned int len)
+{
+    unsigned int old;
+
+    if (c->title != 0) {
+        memcpy(&old, titles + c->title, sizeof(old));
+        titles_dead += TITLESIZE(old);
+        c->title = 0;
+    }
+    if (len == 0)
+        return;
+
+    if (titles_dead > titles_len / 2)
+        titlecompact();
+    if (titles_len + TITLESIZE(len) > titles_size) {
+        titles_size = MAX(titles_size * 2, titles_len + TITLESIZE(len) + 4096);
+        if (!(titles = realloc(titles, titles_size))) {
+            fprintf(stderr, "realloc error!\n");
+            exit(1);
         }
+        if (titles_len == 0)
+            titleappend("", 0); /* offset 0, shared by every untitled client */
+    }
+    c->title = titleappend(text, len);
+}
+
+/* a few stores into the ring, never a system call; the oldest entry goes */
+void trace(unsigned int id, unsigned int a, unsigned int b)
+{
+    struct trace *t = &tracering[tracepos++ & (TRACE_SIZE - 1)];
+
+    t->ns = tracens;
+    t->serial = NextRequest(dpy);
+    t->id = id;
+    t->a = a;
+    t->b = b;
+}
+
+/* fatal signal handler: the whole ring to stderr, then die as we would have */
+void tracecrash(int sig)
+{
+    static const char msg[] = "maxwelm: crashed, trace follows\n";
+    char buf[128];
+    unsigned long i;
+
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    for (i = tracepos - MIN(tracepos, TRACE_SIZE); i < tracepos; i++)
+        write(STDERR_FILENO, buf, tracefmt(buf, &tracering[i & (TRACE_SIZE - 1)]));
+    /* SA_RESETHAND put back the default action, due once we return */
+    raise(sig);
+}
+
+/* one line of text for a trace entry, safe inside a signal handler */
+int tracefmt(char *buf, const struct trace *t)
+{
+    const char *name = t->id < TraceLast ? tracenames[t->id] : "?";
+    char *p = buf;
+
+    p = tracenum(p, t->ns / 1000000000, 10, 0);
+    *p++ = '.';
+    p = tracenum(p, t->ns / 1000 % 1000000, 10, 6);
+    *p++ = ' ';
+    *p++ = '#';
+    p = tracenum(p, t->serial, 10, 0);
+    *p++ = ' ';
+    while (*name)
+        *p++ = *name++;
+    *p++ = ' ';
+    p = tracenum(p, t->a, 16, 0);
+    *p++ = ' ';
+    p = tracenum(p, t->b, 16, 0);
+    *p++ = '\n';
+    return p - buf;
+}
+
+/* v in base, zero padded to width, 0x prefixed in hex; returns the end */
+char *tracenum(char *p, unsigned long v, unsigned int base, int width)
+{
+    char digits[24];
+    int n = 0;
+
+    do {
+        digits[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    if (base == 16) {
+        *p++ = '0';
+        *p++ = 'x';
+    }
+    while (width-- > n)
+        *p++ = '0';
+    while (n)
+        *p++ = digits[--n];
+    return p;
+}
+
+/* stop managing c: give the window back to the root unless it is gone */
+void unmanage(struct client *c, Bool destroyed)
+{
+    struct client *v;
+    unsigned int i;
+
+    TRACE(1, TraceUnmanage, c->win, destroyed);
+    if (c->desktop == currentdesktop)
+        dirty |= DIRTY_FOCUS | DIRTY_BAR | DIRTY_THROTTLE;
+
+    /* never leave a process stopped that no other window of ours covers */
+    for (i = 0; c->frozen && i < clienthash_size; i++)
+        for (v = clienthash[i]; v; v = v->hnext)
+            if (v != c && v->pid == c->pid && v->frozen)
+                c->frozen = False;
+    if (c->frozen)
+        freeze(c, False);
+
+    if (!destroyed) {
+        if (c->hidden)
+            putstates(c, False);
+        /* in place of the frame, so a restart adopts it where it was */
+        XSetWindowBorderWidth(dpy, c->win, c->bw);
+        XReparentWindow(dpy, c->win, root, c->x, c->y);
+        XRemoveFromSaveSet(dpy, c->win);
     }
+    XDestroyWindow(dpy, c->frame);
+    remove_window(c->win);
+}
+
+/* the client withdrew, either by unmapping or with a synthetic event */
+void unmapnotify(XEvent *ev)
+{
+    struct client *c;
+    XUnmapEvent *unev = &ev->xunmap;
+
+    if ((c = wintoclient(unev->window)) && (unev->event == c->frame || unev->send_event))
+        unmanage(c, False);
 }
 
 void update_status(void) {
-    if(!gettextprop(root, XA_WM_NAME, status_text, sizeof(status_text)))
+    if(!gettextprop(getprop(root, XA_WM_NAME), status_text, sizeof(status_text)))
         strcpy(status_text, "maxwelm");
 }
 
 void update_title(struct client *c) 
 {
-    static const char broken[] = "broken";
+    /* both requests go out before waiting for either reply */
+    settitle(c, getprop(c->win, atoms[NetWMName]), getprop(c->win, XA_WM_NAME));
+}
 
-	if (!gettextprop(c->win, NetWMName, c->name, sizeof c->name))
-		gettextprop(c->win, XA_WM_NAME, c->name, sizeof c->name);
-	if (c->name[0] == '\0') /* hack to mark broken Clients */
-		strcpy(c->name, broken);
-    fprintf(stdout, "[%d|%s]", currentdesktop, c->name);
+struct client *wintoclient(Window w)
+{
+    struct client *c;
+
+    if (clienthash_size == 0)
+        return NULL;
+    for (c = clienthash[hash(w)]; c; c = c->hnext)
+        if (c->win == w)
+            return c;
+    return NULL;
 }
 
-int main(void) 
+/* clients can vanish between any two of our requests, ignore what that causes */
+int xerror(Display *dpy, XErrorEvent *ee)
 {
-    if(!(dpy = XOpenDisplay(0x0))) return 1;
+    if (ee->error_code == BadWindow || ee->error_code == BadMatch
+            || ee->error_code == BadDrawable)
+        return 0;
+    TRACE(1, TraceXError, ee->error_code << 8 | ee->request_code, ee->serial);
+    fprintf(stderr, "maxwelm: X error %d on request %d\n", ee->error_code, ee->request_code);
+    return 0;
+}
+
+/* BadAccess on the root while starting up: someone else manages the screen */
+int xerrorstart(Display *dpy, XErrorEvent *ee)
+{
+    fprintf(stderr, "maxwelm: another window manager is already running\n");
+    exit(1);
+    return -1;
+}
+
+int main(int argc, char *argv[]) 
+{
+    const char *capturepath = NULL, *replaypath = NULL;
+    int i;
 
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-R") && i + 1 < argc)
+            capturepath = argv[++i];
+        else if (!strcmp(argv[i], "-P") && i + 1 < argc)
+            replaypath = argv[++i];
+        else if (!strcmp(argv[i], "-t"))
+            replayrealtime = True;
+        else {
+            fprintf(stderr, "usage: maxwelm [-R capture | -P capture [-t]]\n");
+            return 1;
+        }
+    }
+
+    if(!(dpy = XOpenDisplay(0x0))) return 1;
+    /*
+     * Xlib keeps the events and requests, xcb the queries we pipeline.
+     * The server orders the two connections only against what it has
+     * already processed: a query about something we just did through
+     * dpy (a window we created, a property we set) needs XSync(dpy)
+     * first, as in adopt() and replaywin(). Queries about what clients
+     * did need nothing.
+     */
+    if (xcb_connection_has_error(xc = xcb_connect(DisplayString(dpy), NULL))) return 1;
+
+    checkotherwm();
     setup();
 
+    if (capturepath)
+        captureopen(capturepath);
+    else if (replaypath)
+        replayopen(replaypath);
+
     run();
 
     cleanup();
 
     XCloseDisplay(dpy);
+    xcb_disconnect(xc);
+
+    if (restarting) {
+        execvp(argv[0], argv);
+        fprintf(stderr, "maxwelm: can't exec %s\n", argv[0]);
+        return 1;
+    }
 
     return 0;
 }